@@ -0,0 +1,82 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN (sizeof(void *))
+
+static struct arena_block *new_block(size_t size) {
+  struct arena_block *b = malloc(sizeof(*b) + size);
+  if (b == NULL)
+    return NULL;
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (a->head == NULL) {
+    a->head = new_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    if (a->head == NULL)
+      return NULL;
+    a->cur = a->head;
+  }
+
+  struct arena_block *b = a->cur;
+  if (b->size - b->used < size) {
+    // Move on to the next kept block if it is big enough, otherwise link a
+    // new one in right after the current block.
+    if (b->next != NULL && b->next->size >= size) {
+      b = b->next;
+      b->used = 0;
+    } else {
+      struct arena_block *nb =
+          new_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+      if (nb == NULL)
+        return NULL;
+      nb->next = b->next;
+      b->next = nb;
+      b = nb;
+    }
+    a->cur = b;
+  }
+
+  void *p = b->data + b->used;
+  b->used += size;
+  return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len) {
+  char *p = arena_alloc(a, len + 1);
+  if (p == NULL)
+    return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s) {
+  return arena_strndup(a, s, strlen(s));
+}
+
+// Forget every allocation. The blocks stay linked for reuse; later blocks
+// are rewound lazily when arena_alloc() moves on to them.
+void arena_reset(struct arena *a) {
+  if (a->head == NULL)
+    return;
+  a->head->used = 0;
+  a->cur = a->head;
+}
+
+void arena_free(struct arena *a) {
+  struct arena_block *b = a->head;
+  while (b != NULL) {
+    struct arena_block *next = b->next;
+    free(b);
+    b = next;
+  }
+  a->head = a->cur = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator owning everything parsed from one command line. Blocks are
+// kept across arena_reset() and reused, so once the arena has grown to fit
+// the longest line seen, parsing a line does no heap allocation and
+// resetting is O(1).
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+struct arena {
+  struct arena_block *head; // first block
+  struct arena_block *cur;  // block allocations are served from
+};
+
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+char *arena_strdup(struct arena *a, const char *s);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#endif // ARENA_H
@@ -0,0 +1,113 @@
+// Benchmark: heap allocations made while editing a 200 character line, to
+// check that a refresh in the steady state allocates nothing.
+//
+// Usage: alloc_bench [-n chars]
+//
+// The keys come from a pipe, through linenoise's multiplexed API in its test
+// mode (LINENOISE_ASSUME_TTY), and the screen updates go to /dev/null. The
+// line is typed, the cursor moved to its start and back a character at a
+// time, and half of the line deleted with backspace. Allocations are counted
+// by this program's own malloc(), calloc() and realloc(), which every caller
+// in the process uses. Typing may grow the reused buffers (a few times, as
+// they double); the other keys must not allocate, or it exits with status 1.
+
+#include "../linenoise.h"
+#include "bench.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting;
+static long allocs;
+
+void *malloc(size_t size) {
+  allocs += counting;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  allocs += counting;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocs += counting;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n chars]\n", name);
+  exit(2);
+}
+
+// Feed 'n' keys from the pipe and return the allocations they made
+static long feed(struct linenoiseState *l, int n) {
+  long start = allocs;
+
+  for (int i = 0; i < n; i++) {
+    if (linenoiseEditFeed(l) != linenoiseEditMore) {
+      fprintf(stderr, "linenoiseEditFeed: line ended early\n");
+      exit(1);
+    }
+  }
+  return allocs - start;
+}
+
+int main(int argc, char *argv[]) {
+  int chars = 200, opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt != 'n')
+      usage(argv[0]);
+    chars = atoi(optarg);
+  }
+  if (chars <= 0 || chars >= 4096)
+    usage(argv[0]);
+
+  // The line, Ctrl-B and Ctrl-F for every character, backspace for half
+  size_t nkeys = 3 * chars + chars / 2;
+  char *keys = __libc_malloc(nkeys);
+  memset(keys, 2, nkeys);
+  for (int i = 0; i < chars; i++)
+    keys[i] = 'a' + i % 26;
+  memset(keys + 2 * chars, 6, chars);
+  memset(keys + 3 * chars, 127, chars / 2);
+
+  int in[2];
+  int out = open("/dev/null", O_WRONLY);
+  if (pipe(in) == -1 || out == -1) {
+    perror("pipe");
+    return 1;
+  }
+  if (write(in[1], keys, nkeys) != (ssize_t)nkeys) {
+    perror("write");
+    return 1;
+  }
+  close(in[1]);
+
+  setenv("LINENOISE_ASSUME_TTY", "1", 1);
+  setenv("LINENOISE_COLS", "80", 1);
+  struct linenoiseState l;
+  char buf[4096];
+  if (linenoiseEditStart(&l, in[0], out, buf, sizeof(buf), "osh> ") == -1) {
+    perror("linenoiseEditStart");
+    return 1;
+  }
+
+  counting = 1;
+  long typing = feed(&l, chars);
+  long moving = feed(&l, 2 * chars);
+  long deleting = feed(&l, chars / 2);
+  counting = 0;
+  linenoiseEditStop(&l);
+
+  printf("%d character line, %zu keys, 80 columns\n", chars, nkeys);
+  printf("allocations: %ld typing, %ld moving, %ld deleting\n", typing, moving,
+         deleting);
+  __libc_free(keys);
+  return moving + deleting != 0;
+}
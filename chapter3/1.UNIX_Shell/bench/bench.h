@@ -0,0 +1,70 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Helpers shared by the benchmarks in this directory
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Write 'count' copies of 'line' to a new file in /tmp and return its name,
+// which the caller unlinks and frees
+static inline char *write_script(const char *line, long count) {
+  char *path = strdup("/tmp/osh_bench.XXXXXX");
+  int fd = path != NULL ? mkstemp(path) : -1;
+  FILE *f = fd != -1 ? fdopen(fd, "w") : NULL;
+
+  if (f == NULL) {
+    perror("script");
+    exit(1);
+  }
+  for (long i = 0; i < count; i++)
+    fprintf(f, "%s\n", line);
+  if (fclose(f) == EOF) {
+    perror("script");
+    exit(1);
+  }
+  return path;
+}
+
+// Run 'argv' with its output on /dev/null and OSH_SPAWN set to 'spawn' (or
+// unset if it is NULL). Returns the nanoseconds it took.
+static inline uint64_t time_command(char *const argv[], const char *spawn) {
+  uint64_t start = now_ns();
+  int status;
+  pid_t pid = fork();
+
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1)
+      dup2(null, STDOUT_FILENO);
+    if (spawn != NULL)
+      setenv("OSH_SPAWN", spawn, 1);
+    else
+      unsetenv("OSH_SPAWN");
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  waitpid(pid, &status, 0);
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+    exit(1);
+  return now_ns() - start;
+}
+
+#endif // BENCH_H
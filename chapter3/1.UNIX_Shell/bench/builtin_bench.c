@@ -0,0 +1,60 @@
+// Benchmark: time per "echo hi > file" line, run in the shell process by the
+// echo builtin and forked and exec'd as /bin/echo.
+//
+// Usage: builtin_bench [-n lines] [-s shell]
+
+#include "bench.h"
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n lines] [-s shell]\n", name);
+  exit(2);
+}
+
+static double run(char *shell, const char *echo, const char *file,
+                  long lines) {
+  char line[128];
+  snprintf(line, sizeof(line), "%s hi > %s", echo, file);
+
+  char *script = write_script(line, lines);
+  char *args[] = {shell, script, NULL};
+  double elapsed = time_command(args, NULL);
+  unlink(script);
+  free(script);
+  return elapsed / lines / 1000;
+}
+
+int main(int argc, char *argv[]) {
+  char *shell = "bin/shell";
+  long lines = 10000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      lines = atol(optarg);
+      break;
+    case 's':
+      shell = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (lines <= 0)
+    usage(argv[0]);
+
+  char file[] = "/tmp/osh_bench.XXXXXX";
+  int fd = mkstemp(file);
+  if (fd == -1) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  printf("%ld lines per run\n", lines);
+  printf("builtin echo  %8.1f us per line\n", run(shell, "echo", file, lines));
+  printf("/bin/echo     %8.1f us per line\n",
+         run(shell, "/bin/echo", file, lines));
+  unlink(file);
+  return 0;
+}
@@ -0,0 +1,55 @@
+// Benchmark: time to append one line to a full history, which evicts the
+// oldest entry every time.
+//
+// Usage: history_bench [-n lines] [-m max_len]
+//
+// By default 1,000,000 distinct lines go into a 100,000 entry history. The
+// time includes indexing every line for Ctrl-R and for hints.
+
+#include "../linenoise.h"
+#include "bench.h"
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n lines] [-m max_len]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  long lines = 1000000;
+  int max_len = 100000, opt;
+
+  while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+    switch (opt) {
+    case 'n':
+      lines = atol(optarg);
+      break;
+    case 'm':
+      max_len = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (lines <= 0 || max_len <= 0)
+    usage(argv[0]);
+
+  // Format the lines first so only the appends are timed
+  char (*text)[48] = malloc(lines * sizeof(*text));
+  if (text == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  for (long i = 0; i < lines; i++)
+    snprintf(text[i], sizeof(text[i]), "make -C build%ld test", i);
+
+  linenoiseHistorySetMaxLen(max_len);
+  uint64_t start = now_ns();
+  for (long i = 0; i < lines; i++)
+    linenoiseHistoryAdd(text[i]);
+  double elapsed = now_ns() - start;
+
+  printf("%ld lines into a %d entry history\n", lines, max_len);
+  printf("%.0f ns per append\n", elapsed / lines);
+  free(text);
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Benchmark: time to load a large history file at startup.
+//
+// Usage: history_load_bench [-n lines] [-m max_len]
+//
+// A file of 1,000,000 distinct lines is written to a temporary directory
+// and loaded with linenoiseHistoryLoad() into a history of max_len entries
+// (500, the shell's size, by default), which only reads the file's tail.
+
+#include "../linenoise.h"
+#include "bench.h"
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n lines] [-m max_len]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  long lines = 1000000;
+  int max_len = 500, opt;
+
+  while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+    switch (opt) {
+    case 'n':
+      lines = atol(optarg);
+      break;
+    case 'm':
+      max_len = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (lines <= 0 || max_len <= 0)
+    usage(argv[0]);
+
+  char dir[] = "/tmp/osh_bench.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  char file[sizeof(dir) + 16];
+  snprintf(file, sizeof(file), "%s/.osh_history", dir);
+
+  FILE *f = fopen(file, "w");
+  if (f == NULL) {
+    perror(file);
+    return 1;
+  }
+  for (long i = 0; i < lines; i++)
+    fprintf(f, "make -C build%ld test\n", i);
+  long size = ftell(f);
+  if (fclose(f) == EOF) {
+    perror(file);
+    return 1;
+  }
+
+  linenoiseHistorySetMaxLen(max_len);
+  uint64_t start = now_ns();
+  int ret = linenoiseHistoryLoad(file);
+  double elapsed = now_ns() - start;
+
+  unlink(file);
+  rmdir(dir);
+  if (ret != 0) {
+    fprintf(stderr, "linenoiseHistoryLoad: failed\n");
+    return 1;
+  }
+  printf("%ld lines (%.1f MB) into a %d entry history\n", lines, size / 1e6,
+         max_len);
+  printf("loaded in %.3f ms\n", elapsed / 1e6);
+  return 0;
+}
@@ -0,0 +1,95 @@
+// Benchmark: time to parse one command line, over a corpus of real lines
+// (the shell's history file by default).
+//
+// Usage: parse_bench [-r rounds] [corpus]
+//
+// Every line is copied in with set_command_input() and parsed with
+// parse_input(), as the shell does before running it.
+
+#include "../shell.h"
+#include "bench.h"
+
+#define MAX_LINES 100000
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-r rounds] [corpus]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  static char *lines[MAX_LINES];
+  char history[4096], buf[4096];
+  const char *corpus = NULL;
+  int rounds = 100, nr_lines = 0, failed = 0, opt;
+
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    if (opt != 'r')
+      usage(argv[0]);
+    rounds = atoi(optarg);
+  }
+  if (optind < argc) {
+    corpus = argv[optind];
+  } else {
+    snprintf(history, sizeof(history), "%s/.osh_history",
+             getenv("HOME") != NULL ? getenv("HOME") : ".");
+    corpus = history;
+  }
+  if (rounds <= 0)
+    usage(argv[0]);
+
+  FILE *f = fopen(corpus, "r");
+  if (f == NULL) {
+    perror(corpus);
+    return 1;
+  }
+  while (nr_lines < MAX_LINES && fgets(buf, sizeof(buf), f) != NULL) {
+    buf[strcspn(buf, "\n")] = '\0';
+    if (buf[0] != '\0' && (lines[nr_lines] = strdup(buf)) != NULL)
+      nr_lines++;
+  }
+  fclose(f);
+  if (nr_lines == 0) {
+    fprintf(stderr, "%s: no lines\n", corpus);
+    return 1;
+  }
+
+  // One untimed pass, which also shows the parse errors
+  struct Command cmd = {0};
+  for (int i = 0; i < nr_lines; i++) {
+    reset_command(&cmd);
+    if (set_command_input(&cmd, lines[i]) == -1 || parse_input(&cmd) == -1)
+      failed++;
+  }
+  // The timed passes' errors (on stdout or stderr) go to /dev/null
+  fflush(stdout);
+  int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (saved_out == -1 || saved_err == -1 || null == -1) {
+    perror("dup");
+    return 1;
+  }
+  dup2(null, STDOUT_FILENO);
+  dup2(null, STDERR_FILENO);
+
+  uint64_t start = now_ns();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < nr_lines; i++) {
+      reset_command(&cmd);
+      if (set_command_input(&cmd, lines[i]) == 0)
+        parse_input(&cmd);
+    }
+  }
+  double elapsed = now_ns() - start;
+  fflush(stdout);
+  dup2(saved_out, STDOUT_FILENO);
+  dup2(saved_err, STDERR_FILENO);
+
+  printf("%d lines from %s (%d failed to parse), %d rounds\n", nr_lines,
+         corpus, failed, rounds);
+  printf("%.0f ns per line\n", elapsed / ((double)rounds * nr_lines));
+
+  free_command(&cmd);
+  for (int i = 0; i < nr_lines; i++)
+    free(lines[i]);
+  return 0;
+}
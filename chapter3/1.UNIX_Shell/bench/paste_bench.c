@@ -0,0 +1,143 @@
+// Benchmark: time for the shell to take a 64 KB paste, through a pty.
+//
+// Usage: paste_bench [-n bytes] [-u] [-s shell]
+//
+// The shell runs interactively on a pseudo terminal. The text is sent
+// between the bracketed paste markers (or without them with -u, as a
+// terminal without bracketed paste would type it), followed by Ctrl-U and
+// "echo DONE" and Enter; the time is until DONE comes back. The line only
+// holds 4 KB, so most of the text is cut, but all of it has to be read.
+// The shell's HOME is a temporary directory, to keep the paste out of the
+// real history.
+
+#include "bench.h"
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n bytes] [-u] [-s shell]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  char *shell = "bin/shell";
+  size_t size = 65536;
+  int bracketed = 1, opt;
+
+  while ((opt = getopt(argc, argv, "n:us:")) != -1) {
+    switch (opt) {
+    case 'n':
+      size = strtoul(optarg, NULL, 10);
+      break;
+    case 'u':
+      bracketed = 0;
+      break;
+    case 's':
+      shell = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  static const char start_marker[] = "\x1b[200~", end_marker[] = "\x1b[201~";
+  static const char done[] = "\x15" "echo DONE\r";
+  size_t len = 0;
+  char *input = malloc(size + 64);
+  if (input == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  if (bracketed) {
+    memcpy(input, start_marker, 6);
+    len = 6;
+  }
+  memset(input + len, 'a', size);
+  len += size;
+  if (bracketed) {
+    memcpy(input + len, end_marker, 6);
+    len += 6;
+  }
+  memcpy(input + len, done, sizeof(done) - 1);
+  len += sizeof(done) - 1;
+
+  char home[] = "/tmp/osh_bench.XXXXXX";
+  if (mkdtemp(home) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  struct winsize ws = {.ws_row = 24, .ws_col = 80};
+  int master;
+  pid_t pid = forkpty(&master, NULL, NULL, &ws);
+  if (pid == -1) {
+    perror("forkpty");
+    return 1;
+  }
+  if (pid == 0) {
+    setenv("HOME", home, 1);
+    setenv("TERM", "xterm", 1);
+    execl(shell, shell, (char *)NULL);
+    perror(shell);
+    _exit(127);
+  }
+
+  // Send the input once the first prompt is shown, and time until DONE
+  char out[65536] = "";
+  size_t out_len = 0;
+  uint64_t start = 0;
+  size_t sent = 0;
+  int finished = 0;
+
+  while (!finished) {
+    struct pollfd pfd = {master, POLLIN, 0};
+    int ready = start != 0 || strstr(out, "osh> ") != NULL;
+    if (ready && start == 0)
+      start = now_ns();
+    if (ready && sent < len)
+      pfd.events |= POLLOUT;
+    if (poll(&pfd, 1, 5000) <= 0) {
+      fprintf(stderr, "%s: timed out (%zu of %zu bytes sent)\n", argv[0],
+              sent, len);
+      break;
+    }
+    if (pfd.revents & POLLOUT) {
+      ssize_t n = write(master, input + sent, len - sent);
+      if (n > 0)
+        sent += n;
+    }
+    if (pfd.revents & (POLLIN | POLLHUP)) {
+      // Keep the tail, in case a match is split between reads
+      if (out_len > sizeof(out) / 2) {
+        memmove(out, out + out_len - 64, 64);
+        out_len = 64;
+      }
+      ssize_t n = read(master, out + out_len, sizeof(out) - 1 - out_len);
+      if (n == 0 || (n == -1 && errno != EINTR))
+        break;
+      if (n > 0)
+        out_len += n;
+      out[out_len] = '\0';
+      finished = sent == len && strstr(out, "\r\nDONE") != NULL;
+    }
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(master);
+  char history[sizeof(home) + 16];
+  snprintf(history, sizeof(history), "%s/.osh_history", home);
+  unlink(history);
+  rmdir(home);
+  free(input);
+  if (!finished)
+    return 1;
+
+  printf("%zu bytes pasted %s bracketed paste\n", size,
+         bracketed ? "with" : "without");
+  printf("%.3f s (%.1f MB/s)\n", elapsed, size / elapsed / 1e6);
+  return 0;
+}
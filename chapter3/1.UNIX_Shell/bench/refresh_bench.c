@@ -0,0 +1,144 @@
+// Benchmark: bytes the shell writes to the terminal per keystroke while a
+// line is edited, redrawing only what changed (refreshDiff()) and rewriting
+// the whole line every time (LINENOISE_FULL_REFRESH).
+//
+// Usage: refresh_bench [-s shell]
+//
+// The shell runs interactively on an 80 column pseudo terminal. Once the
+// prompt is shown a line is typed, the cursor moved into it, a few
+// characters inserted and deleted there, and the cursor moved back to the
+// end; then everything the shell writes until it goes quiet is counted.
+// The shell's HOME is a temporary directory, so no history hints are shown.
+
+#include "bench.h"
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-s shell]\n", name);
+  exit(2);
+}
+
+// Run the shell, send 'keys' after its first prompt and return the bytes it
+// wrote for them, or -1 on error
+static long run(char *shell, const char *keys, size_t nkeys, int full) {
+  char home[] = "/tmp/osh_bench.XXXXXX";
+  if (mkdtemp(home) == NULL) {
+    perror("mkdtemp");
+    return -1;
+  }
+
+  struct winsize ws = {.ws_row = 24, .ws_col = 80};
+  int master;
+  pid_t pid = forkpty(&master, NULL, NULL, &ws);
+  if (pid == -1) {
+    perror("forkpty");
+    return -1;
+  }
+  if (pid == 0) {
+    setenv("HOME", home, 1);
+    setenv("TERM", "xterm", 1);
+    if (full)
+      setenv("LINENOISE_FULL_REFRESH", "1", 1);
+    execl(shell, shell, (char *)NULL);
+    perror(shell);
+    _exit(127);
+  }
+
+  // Count from the first prompt on, until nothing came for 300 ms
+  char out[4096] = "";
+  size_t out_len = 0, sent = 0;
+  long bytes = -1;
+  int timeout = 5000;
+
+  for (;;) {
+    struct pollfd pfd = {master, POLLIN, 0};
+    if (bytes >= 0 && sent < nkeys)
+      pfd.events |= POLLOUT;
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == 0 && bytes >= 0 && sent == nkeys)
+      break;
+    if (ready <= 0) {
+      fprintf(stderr, "%s: timed out\n", shell);
+      bytes = -1;
+      break;
+    }
+    if (pfd.revents & POLLOUT) {
+      ssize_t n = write(master, keys + sent, nkeys - sent);
+      if (n > 0)
+        sent += n;
+    }
+    if (pfd.revents & (POLLIN | POLLHUP)) {
+      char buf[4096];
+      ssize_t n = read(master, buf, sizeof(buf));
+      if (n == 0 || (n == -1 && errno != EINTR)) {
+        bytes = -1;
+        break;
+      }
+      if (n <= 0)
+        continue;
+      if (bytes >= 0) {
+        bytes += n;
+      } else if (out_len + n < sizeof(out)) {
+        memcpy(out + out_len, buf, n);
+        out_len += n;
+        out[out_len] = '\0';
+        if (strstr(out, "osh> ") != NULL) {
+          bytes = 0;
+          timeout = 300;
+        }
+      }
+    }
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(master);
+  char history[sizeof(home) + 16];
+  snprintf(history, sizeof(history), "%s/.osh_history", home);
+  unlink(history);
+  rmdir(home);
+  return bytes;
+}
+
+int main(int argc, char *argv[]) {
+  char *shell = "bin/shell";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    if (opt != 's')
+      usage(argv[0]);
+    shell = optarg;
+  }
+
+  // Type the line, go 20 characters back (Ctrl-B), insert and delete five
+  // there, and go back to the end (Ctrl-F)
+  static const char line[] = "echo the quick brown fox jumps over the lazy dog";
+  char keys[256];
+  size_t nkeys = 0;
+  memcpy(keys, line, sizeof(line) - 1);
+  nkeys += sizeof(line) - 1;
+  memset(keys + nkeys, 2, 20);
+  nkeys += 20;
+  memset(keys + nkeys, 'X', 5);
+  nkeys += 5;
+  memset(keys + nkeys, 127, 5);
+  nkeys += 5;
+  memset(keys + nkeys, 6, 20);
+  nkeys += 20;
+
+  long diff = run(shell, keys, nkeys, 0);
+  long full = run(shell, keys, nkeys, 1);
+  if (diff < 0 || full < 0)
+    return 1;
+
+  printf("%zu keystrokes on a %zu character line, 80 columns\n", nkeys,
+         sizeof(line) - 1);
+  printf("changed part only  %6ld bytes (%.1f per keystroke)\n", diff,
+         (double)diff / nkeys);
+  printf("whole line         %6ld bytes (%.1f per keystroke)\n", full,
+         (double)full / nkeys);
+  return 0;
+}
@@ -0,0 +1,48 @@
+// Benchmark: commands per second of a script run by the shell.
+//
+// Usage: script_bench [-n lines] [-l line] [-s shell]
+//
+// The script is n copies of one trivial line ("cd ." by default, a builtin,
+// so the time is the shell's own reading, parsing and dispatch).
+
+#include "bench.h"
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n lines] [-l line] [-s shell]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  char *shell = "bin/shell";
+  const char *line = "cd .";
+  long lines = 100000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:l:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      lines = atol(optarg);
+      break;
+    case 'l':
+      line = optarg;
+      break;
+    case 's':
+      shell = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (lines <= 0)
+    usage(argv[0]);
+
+  char *script = write_script(line, lines);
+  char *args[] = {shell, script, NULL};
+  double elapsed = time_command(args, NULL) / 1e9;
+
+  printf("%ld lines of \"%s\" in %.3f s\n", lines, line, elapsed);
+  printf("%.0f commands/s\n", lines / elapsed);
+  unlink(script);
+  free(script);
+  return 0;
+}
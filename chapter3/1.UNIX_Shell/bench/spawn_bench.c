@@ -0,0 +1,54 @@
+// Benchmark: time to start one pipeline stage, with the posix_spawn()
+// backend and with OSH_SPAWN=fork, for 1, 4 and 16 stage pipelines.
+//
+// Usage: spawn_bench [-n pipelines] [-s shell]
+//
+// Every measurement is one script of n copies of "true | true | ... | true"
+// run by the shell; its time is divided by the number of stages started.
+
+#include "bench.h"
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n pipelines] [-s shell]\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  static const int stages[] = {1, 4, 16};
+  char *shell = "bin/shell";
+  long pipelines = 500;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      pipelines = atol(optarg);
+      break;
+    case 's':
+      shell = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (pipelines <= 0)
+    usage(argv[0]);
+
+  printf("%ld pipelines per run\n", pipelines);
+  printf("stages  posix_spawn      fork  (us per stage)\n");
+  for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+    char line[16 * sizeof("true | ")] = "true";
+    for (int j = 1; j < stages[i]; j++)
+      strcat(line, " | true");
+
+    char *script = write_script(line, pipelines);
+    char *args[] = {shell, script, NULL};
+    double n = (double)pipelines * stages[i];
+    double spawn = time_command(args, NULL) / n / 1000;
+    double fork = time_command(args, "fork") / n / 1000;
+    printf("%6d  %11.1f  %8.1f\n", stages[i], spawn, fork);
+    unlink(script);
+    free(script);
+  }
+  return 0;
+}
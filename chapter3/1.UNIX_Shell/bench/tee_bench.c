@@ -0,0 +1,83 @@
+// Benchmark: throughput of "cat file | tee /dev/null | wc -c" run by the
+// shell, with the tee builtin's zero-copy path (tee(2) and splice(2)), with
+// its read()/write() loop (-a, which splice(2) refuses), and with
+// /usr/bin/tee.
+//
+// Usage: tee_bench [-m megabytes] [-r rounds] [-s shell]
+//
+// The file is created in /tmp and read 'rounds' times per run, so it is
+// served from the page cache.
+
+#include "bench.h"
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-m megabytes] [-r rounds] [-s shell]\n", name);
+  exit(2);
+}
+
+static double run(char *shell, const char *tee, const char *file, int rounds,
+                  double bytes) {
+  // One line per round: "cat" exits at the end of the file
+  char line[256];
+  snprintf(line, sizeof(line), "cat %s | %s /dev/null | wc -c", file, tee);
+
+  char *script = write_script(line, rounds);
+  char *args[] = {shell, script, NULL};
+  double elapsed = time_command(args, NULL) / 1e9;
+  unlink(script);
+  free(script);
+  return bytes * rounds / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  char *shell = "bin/shell";
+  long megabytes = 1024;
+  int rounds = 3, opt;
+
+  while ((opt = getopt(argc, argv, "m:r:s:")) != -1) {
+    switch (opt) {
+    case 'm':
+      megabytes = atol(optarg);
+      break;
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 's':
+      shell = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (megabytes <= 0 || rounds <= 0)
+    usage(argv[0]);
+
+  char file[] = "/tmp/osh_bench.XXXXXX";
+  int fd = mkstemp(file);
+  char *block = malloc(1 << 20);
+  if (fd == -1 || block == NULL) {
+    perror("data file");
+    return 1;
+  }
+  memset(block, 'x', 1 << 20);
+  for (long i = 0; i < megabytes; i++) {
+    if (write(fd, block, 1 << 20) != 1 << 20) {
+      perror(file);
+      unlink(file);
+      return 1;
+    }
+  }
+  close(fd);
+  free(block);
+
+  double bytes = (double)(megabytes << 20);
+  printf("%ld MB, %d rounds per run\n", megabytes, rounds);
+  printf("tee (splice)        %6.2f GB/s\n",
+         run(shell, "tee", file, rounds, bytes));
+  printf("tee -a (copy loop)  %6.2f GB/s\n",
+         run(shell, "tee -a", file, rounds, bytes));
+  printf("/usr/bin/tee        %6.2f GB/s\n",
+         run(shell, "/usr/bin/tee", file, rounds, bytes));
+  unlink(file);
+  return 0;
+}
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE // splice(), tee()
+#include "builtins.h"
+#include "complete.h"
+#include "hash.h"
+#include "jobs.h"
+#include "linenoise.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEE_CHUNK (64 * 1024)
+
+extern char **environ;
+
+static bool exit_requested = false;
+
+// "exit" ends the shell once the current line is done
+bool builtin_exit_requested(void) { return exit_requested; }
+
+// cd [dir | -]: no dir means $HOME, "-" means $OLDPWD (and prints it).
+// PWD and OLDPWD are updated for the commands run afterwards.
+static int builtin_cd(char **argv) {
+  const char *dir = argv[1];
+  bool print = false;
+
+  if (dir != NULL && argv[2] != NULL) {
+    fprintf(stderr, "cd: too many arguments\n");
+    return 1;
+  }
+  if (dir == NULL && (dir = getenv("HOME")) == NULL) {
+    fprintf(stderr, "cd: HOME not set\n");
+    return 1;
+  }
+  if (strcmp(dir, "-") == 0) {
+    if ((dir = getenv("OLDPWD")) == NULL) {
+      fprintf(stderr, "cd: OLDPWD not set\n");
+      return 1;
+    }
+    print = true;
+  }
+
+  char *old = getcwd(NULL, 0);
+  if (chdir(dir) == -1) {
+    fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+    free(old);
+    return 1;
+  }
+  char *cwd = getcwd(NULL, 0);
+  if (old != NULL)
+    setenv("OLDPWD", old, 1);
+  if (cwd != NULL) {
+    setenv("PWD", cwd, 1);
+    if (print)
+      printf("%s\n", cwd);
+  }
+  free(old);
+  free(cwd);
+  return 0;
+}
+
+static int builtin_clear(char **argv) {
+  (void)argv;
+  linenoiseClearScreen();
+  return 0;
+}
+
+// echo [-n] [args]: print the arguments separated by spaces
+static int builtin_echo(char **argv) {
+  bool newline = true;
+  int i = 1;
+
+  if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+    newline = false;
+    i++;
+  }
+  for (; argv[i] != NULL; i++) {
+    fputs(argv[i], stdout);
+    if (argv[i + 1] != NULL)
+      putchar(' ');
+  }
+  if (newline)
+    putchar('\n');
+  return 0;
+}
+
+// exec cmd [args]: replace the shell with cmd
+static int builtin_exec(char **argv) {
+  if (argv[1] == NULL)
+    return 0;
+  const char *path = hash_lookup(argv[1]);
+  if (path == NULL) {
+    fprintf(stderr, "%s: command not found\n", argv[1]);
+    return 127;
+  }
+
+  // Undo what jobs_init() set up for the shell itself, keeping the old
+  // dispositions in case the exec fails
+  struct sigaction dfl, saved[NSIG];
+  sigset_t set, none, mask;
+  memset(&dfl, 0, sizeof(dfl));
+  dfl.sa_handler = SIG_DFL;
+  job_default_signals(&set);
+  for (int sig = 1; sig < NSIG; sig++)
+    if (sigismember(&set, sig) == 1)
+      sigaction(sig, &dfl, &saved[sig]);
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, &mask);
+
+  fflush(stdout);
+  execv(path, argv + 1);
+  int err = errno;
+  fprintf(stderr, "exec: %s: %s\n", argv[1], strerror(err));
+  hash_forget(argv[1]);
+  for (int sig = 1; sig < NSIG; sig++)
+    if (sigismember(&set, sig) == 1)
+      sigaction(sig, &saved[sig], NULL);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  return err == ENOENT ? 127 : 126;
+}
+
+// exit [n]: exit with status n, or the last command's
+static int builtin_exit(char **argv) {
+  int status = jobs_last_status();
+
+  exit_requested = true;
+  if (argv[1] != NULL) {
+    char *end;
+    errno = 0;
+    long n = strtol(argv[1], &end, 10);
+    if (*argv[1] == '\0' || *end != '\0' || errno == ERANGE) {
+      fprintf(stderr, "exit: %s: numeric argument required\n", argv[1]);
+      return 2;
+    }
+    status = (int)(n & 0xff);
+  }
+  return status;
+}
+
+static bool is_name(const char *s, size_t len) {
+  if (len == 0 || isdigit((unsigned char)s[0]))
+    return false;
+  for (size_t i = 0; i < len; i++)
+    if (!isalnum((unsigned char)s[i]) && s[i] != '_')
+      return false;
+  return true;
+}
+
+// export [NAME=value | NAME]...: set environment variables. Without
+// arguments, list the environment.
+static int builtin_export(char **argv) {
+  int status = 0;
+
+  if (argv[1] == NULL) {
+    for (char **e = environ; *e != NULL; e++)
+      printf("export %s\n", *e);
+    return 0;
+  }
+  for (int i = 1; argv[i] != NULL; i++) {
+    char *eq = strchr(argv[i], '=');
+    size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+    if (!is_name(argv[i], len)) {
+      fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    // There are no shell variables, so a bare NAME has nothing to export
+    if (eq == NULL)
+      continue;
+    *eq = '\0';
+    if (setenv(argv[i], eq + 1, 1) == -1) {
+      fprintf(stderr, "export: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+    }
+    *eq = '=';
+  }
+  return status;
+}
+
+// hash: show the command hash table; hash -r: empty it; hash name...:
+// look the names up now
+static int builtin_hash(char **argv) {
+  int status = 0;
+
+  if (argv[1] == NULL) {
+    hash_print();
+    return 0;
+  }
+  for (int i = 1; argv[i] != NULL; i++) {
+    if (strcmp(argv[i], "-r") == 0) {
+      hash_reset();
+      complete_reset();
+    } else if (hash_lookup(argv[i]) == NULL) {
+      fprintf(stderr, "hash: %s: not found\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+static int builtin_pwd(char **argv) {
+  (void)argv;
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL) {
+    perror("pwd");
+    return 1;
+  }
+  printf("%s\n", cwd);
+  free(cwd);
+  return 0;
+}
+
+static char tee_buf[TEE_CHUNK];
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Write 'len' bytes of tee_buf to every file still open, closing the ones
+// that fail. Returns 1 if any failed.
+static int tee_write_files(int *fds, char **names, int nfiles, size_t len) {
+  int status = 0;
+  for (int i = 0; i < nfiles; i++) {
+    if (fds[i] != -1 && write_all(fds[i], tee_buf, len) == -1) {
+      fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+      close(fds[i]);
+      fds[i] = -1;
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Copy stdin to stdout and the files through tee_buf
+static int tee_copy(int *fds, char **names, int nfiles) {
+  int status = 0;
+  while (true) {
+    ssize_t n = read(STDIN_FILENO, tee_buf, sizeof(tee_buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      perror("tee: read");
+      return 1;
+    }
+    if (n == 0)
+      return status;
+    if (write_all(STDOUT_FILENO, tee_buf, n) == -1) {
+      perror("tee: write");
+      return 1;
+    }
+    status |= tee_write_files(fds, names, nfiles, n);
+  }
+}
+
+// Zero-copy tee for when stdin and stdout are both pipes and there is at
+// most one file. tee(2) duplicates what is waiting in the input pipe into
+// the output pipe, then splice(2) moves the same bytes from the input pipe
+// into the file, so the data never passes through user space. With no file
+// the input is spliced straight to the output.
+// Returns the exit status, or -1 to finish with tee_copy(): when the kernel
+// refuses to splice (an O_APPEND file, a file system without splice
+// support) after everything so far has been written.
+static int tee_splice(int *fd, char *name) {
+  while (true) {
+    ssize_t n;
+    if (*fd == -1)
+      n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, TEE_CHUNK,
+                 SPLICE_F_MOVE);
+    else
+      n = tee(STDIN_FILENO, STDOUT_FILENO, TEE_CHUNK, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EINVAL)
+      return -1;
+    if (n == -1) {
+      perror("tee");
+      return 1;
+    }
+    if (n == 0)
+      return 0;
+
+    while (*fd != -1 && n > 0) {
+      ssize_t m = splice(STDIN_FILENO, NULL, *fd, NULL, n, SPLICE_F_MOVE);
+      if (m == -1 && errno == EINTR)
+        continue;
+      if (m == -1) {
+        // These bytes are already in stdout: take them out of the input
+        // pipe by hand so the file gets them (or its error is reported)
+        while (n > 0) {
+          ssize_t r = read(STDIN_FILENO, tee_buf, n);
+          if (r == -1 && errno == EINTR)
+            continue;
+          if (r <= 0) {
+            perror("tee: read");
+            return 1;
+          }
+          n -= r;
+          if (tee_write_files(fd, &name, 1, r) != 0)
+            return 1;
+        }
+        return -1;
+      }
+      n -= m;
+    }
+  }
+}
+
+static bool is_pipe(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// tee [-a] [file...]: copy stdin to stdout and to each file. Runs in its
+// own process as a pipeline stage.
+static int builtin_tee(char **argv) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int argc = 1;
+  int status = 0;
+
+  if (argv[1] != NULL && strcmp(argv[1], "-a") == 0) {
+    flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    argv++;
+  }
+  while (argv[argc] != NULL)
+    argc++;
+
+  int fds[argc];
+  char **names = argv + 1;
+  int nfiles = 0;
+  for (int i = 0; i < argc - 1; i++) {
+    int fd = open(names[i], flags, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    names[nfiles] = names[i];
+    fds[nfiles++] = fd;
+  }
+
+  int result = -1;
+  if (nfiles <= 1 && is_pipe(STDIN_FILENO) && is_pipe(STDOUT_FILENO)) {
+    int none = -1;
+    result = tee_splice(nfiles == 1 ? &fds[0] : &none,
+                        nfiles == 1 ? names[0] : NULL);
+  }
+  if (result == -1)
+    result = tee_copy(fds, names, nfiles);
+  status |= result;
+
+  for (int i = 0; i < nfiles; i++)
+    if (fds[i] != -1 && close(fds[i]) == -1) {
+      fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+      status = 1;
+    }
+  return status;
+}
+
+// type name...: say whether each name is a builtin or where it is found
+static int builtin_type(char **argv) {
+  int status = 0;
+
+  for (int i = 1; argv[i] != NULL; i++) {
+    const char *path;
+    if (builtin_lookup(argv[i]) != NULL) {
+      printf("%s is a shell builtin\n", argv[i]);
+    } else if ((path = hash_lookup(argv[i])) != NULL) {
+      printf("%s is %s\n", argv[i], path);
+    } else {
+      fprintf(stderr, "type: %s: not found\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Sorted by name for builtin_lookup()
+static const struct builtin builtins[] = {
+    {"bg", builtin_bg, false},         {"cd", builtin_cd, false},
+    {"clear", builtin_clear, false},   {"echo", builtin_echo, false},
+    {"exec", builtin_exec, false},     {"exit", builtin_exit, false},
+    {"export", builtin_export, false}, {"fg", builtin_fg, false},
+    {"hash", builtin_hash, false},     {"jobs", builtin_jobs, false},
+    {"pwd", builtin_pwd, false},       {"tee", builtin_tee, true},
+    {"type", builtin_type, false},     {"wait", builtin_wait, false},
+};
+
+static int compare_builtin(const void *key, const void *entry) {
+  return strcmp(key, ((const struct builtin *)entry)->name);
+}
+
+// Return the builtin called 'name', or NULL
+const struct builtin *builtin_lookup(const char *name) {
+  return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]),
+                 sizeof(builtins[0]), compare_builtin);
+}
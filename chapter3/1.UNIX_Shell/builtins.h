@@ -0,0 +1,23 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <stdbool.h>
+
+// Commands the shell runs itself. They are looked up by argv[0] after
+// parsing and run in the shell process, so they can change its state (cd,
+// export, exit) and cost no fork. The ones marked 'forks' work on data
+// streams instead: they run in a child like an external command, so they
+// can be pipeline stages, background jobs and killed with Ctrl+C.
+
+typedef int builtin_func(char **argv); // returns the exit status
+
+struct builtin {
+  const char *name;
+  builtin_func *func;
+  bool forks; // run in a child process, never in the shell
+};
+
+const struct builtin *builtin_lookup(const char *name);
+bool builtin_exit_requested(void);
+
+#endif // BUILTINS_H
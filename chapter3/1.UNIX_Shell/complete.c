@@ -0,0 +1,379 @@
+#include "complete.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define DIR_CACHE_SIZE 8      // directories kept listed for file names
+#define GETDENTS_BUF (64 * 1024)
+#define MAX_COMPLETIONS 1000  // Tab cycles through these, so more is no use
+
+// Record layout of getdents64(2)
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// A directory listing. Each entry is stored in 'names' as its d_type byte
+// followed by the name and a NUL; 'sorted' points at the names, in order.
+struct dir_list {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime; // listing is stale once the directory's differs
+  char *names;
+  char **sorted;
+  size_t count;
+  unsigned long used; // for LRU eviction
+};
+
+static struct dir_list dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_clock = 0;
+
+// Command index: one listing per $PATH directory, merged into 'commands'.
+static char *indexed_path_env = NULL;
+static struct dir_list *path_dirs = NULL;
+static char **path_names = NULL; // directory of each entry of path_dirs
+static int npath_dirs = 0;
+static char **commands = NULL; // sorted, without duplicates
+static size_t ncommands = 0;
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void dir_free(struct dir_list *d) {
+  free(d->names);
+  free(d->sorted);
+  memset(d, 0, sizeof(*d));
+}
+
+static bool dir_current(const struct dir_list *d, const struct stat *st) {
+  return d->sorted != NULL && d->dev == st->st_dev && d->ino == st->st_ino &&
+         d->mtime.tv_sec == st->st_mtim.tv_sec &&
+         d->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Keep regular files with an execute bit. Links and unknown types are
+// followed with fstatat().
+static bool is_command(int dirfd, const struct linux_dirent64 *e) {
+  struct stat st;
+  if (e->d_type != DT_REG && e->d_type != DT_LNK && e->d_type != DT_UNKNOWN)
+    return false;
+  return fstatat(dirfd, e->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+         (st.st_mode & 0111);
+}
+
+// (Re)read directory 'path' into 'd' with getdents64(), keeping only
+// executables if 'commands_only' is set. On failure 'd' is left empty.
+static int dir_read(struct dir_list *d, const char *path,
+                    const struct stat *st, bool commands_only) {
+  dir_free(d);
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  char *buf = malloc(GETDENTS_BUF);
+  size_t len = 0, cap = 0;
+  char *names = NULL;
+  if (buf == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  long nread;
+  while ((nread = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF)) > 0) {
+    for (long off = 0; off < nread;) {
+      struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + off);
+      off += e->d_reclen;
+      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+        continue;
+      if (commands_only && !is_command(fd, e))
+        continue;
+
+      size_t n = strlen(e->d_name) + 2;
+      if (len + n > cap) {
+        size_t new_cap = cap ? cap * 2 : 4096;
+        while (new_cap < len + n)
+          new_cap *= 2;
+        char *p = realloc(names, new_cap);
+        if (p == NULL) {
+          nread = -1;
+          break;
+        }
+        names = p;
+        cap = new_cap;
+      }
+      names[len] = e->d_type;
+      memcpy(names + len + 1, e->d_name, n - 1);
+      len += n;
+      d->count++;
+    }
+    if (nread == -1)
+      break;
+  }
+  free(buf);
+  close(fd);
+
+  // An empty listing still needs a (non-NULL) 'sorted' to count as read
+  d->sorted = malloc((d->count ? d->count : 1) * sizeof(char *));
+  if (nread == -1 || d->sorted == NULL) {
+    free(names);
+    dir_free(d);
+    return -1;
+  }
+  d->names = names;
+  size_t i = 0;
+  for (size_t off = 0; off < len; off += strlen(names + off + 1) + 2)
+    d->sorted[i++] = names + off + 1;
+  qsort(d->sorted, d->count, sizeof(char *), compare_names);
+
+  d->dev = st->st_dev;
+  d->ino = st->st_ino;
+  d->mtime = st->st_mtim;
+#ifdef DEBUG
+  printf("DEBUG: listed %s (%zu entries)\n", path, d->count);
+#endif
+  return 0;
+}
+
+// Index of the first of the 'n' sorted names that is >= 'prefix'
+static size_t lower_bound(char **names, size_t n, const char *prefix) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(names[mid], prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Return the cached listing of 'path', reading it if it isn't cached or
+// the directory changed since. NULL if it can't be read.
+static struct dir_list *dir_lookup(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  // Directories are told apart by inode, so "." follows cd
+  struct dir_list *d = NULL, *lru = &dir_cache[0];
+  for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+    struct dir_list *c = &dir_cache[i];
+    if (c->sorted != NULL && c->dev == st.st_dev && c->ino == st.st_ino) {
+      d = c;
+      break;
+    }
+    if (c->used < lru->used)
+      lru = c;
+  }
+  if (d == NULL)
+    d = lru;
+  if (!dir_current(d, &st) && dir_read(d, path, &st, false) == -1)
+    return NULL;
+  d->used = ++dir_clock;
+  return d;
+}
+
+static void path_index_free(void) {
+  for (int i = 0; i < npath_dirs; i++) {
+    dir_free(&path_dirs[i]);
+    free(path_names[i]);
+  }
+  free(path_dirs);
+  free(path_names);
+  free(commands);
+  free(indexed_path_env);
+  path_dirs = NULL;
+  path_names = NULL;
+  commands = NULL;
+  indexed_path_env = NULL;
+  npath_dirs = 0;
+  ncommands = 0;
+}
+
+// Split $PATH into path_names, with a listing slot for each directory
+static int path_index_init(const char *path_env) {
+  int n = 1;
+  for (const char *p = path_env; *p; p++)
+    n += *p == ':';
+  path_dirs = calloc(n, sizeof(*path_dirs));
+  path_names = calloc(n, sizeof(*path_names));
+  indexed_path_env = strdup(path_env);
+  if (path_dirs == NULL || path_names == NULL || indexed_path_env == NULL)
+    return -1;
+
+  const char *dir = path_env;
+  for (npath_dirs = 0; npath_dirs < n; npath_dirs++) {
+    const char *end = strchr(dir, ':');
+    size_t len = end ? (size_t)(end - dir) : strlen(dir);
+    // An empty PATH entry means the current directory
+    path_names[npath_dirs] = len ? strndup(dir, len) : strdup(".");
+    if (path_names[npath_dirs] == NULL)
+      return -1;
+    dir = end ? end + 1 : dir + len;
+  }
+  return 0;
+}
+
+// Bring the command index up to date: list again every $PATH directory
+// whose mtime changed and merge the listings if any did.
+static void path_index_update(void) {
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = DEFAULT_PATH;
+  if (indexed_path_env == NULL || strcmp(indexed_path_env, path_env) != 0) {
+    path_index_free();
+    if (path_index_init(path_env) == -1) {
+      path_index_free();
+      return;
+    }
+  }
+
+  bool changed = commands == NULL;
+  size_t total = 0;
+  for (int i = 0; i < npath_dirs; i++) {
+    struct dir_list *d = &path_dirs[i];
+    struct stat st;
+    if (stat(path_names[i], &st) == -1 || !S_ISDIR(st.st_mode)) {
+      changed |= d->sorted != NULL;
+      dir_free(d);
+    } else if (!dir_current(d, &st)) {
+      dir_read(d, path_names[i], &st, true);
+      changed = true;
+    }
+    total += d->count;
+  }
+  if (!changed)
+    return;
+
+  free(commands);
+  ncommands = 0;
+  commands = malloc((total ? total : 1) * sizeof(char *));
+  if (commands == NULL)
+    return;
+  for (int i = 0; i < npath_dirs; i++) {
+    memcpy(commands + ncommands, path_dirs[i].sorted,
+           path_dirs[i].count * sizeof(char *));
+    ncommands += path_dirs[i].count;
+  }
+  qsort(commands, ncommands, sizeof(char *), compare_names);
+  size_t j = 0;
+  for (size_t i = 0; i < ncommands; i++) {
+    if (j == 0 || strcmp(commands[j - 1], commands[i]) != 0)
+      commands[j++] = commands[i];
+  }
+  ncommands = j;
+}
+
+// Offer 'line' (the text before the word) + 'dir' + 'name' + 'suffix'
+static void add_completion(linenoiseCompletions *lc, const char *line,
+                           size_t line_len, const char *dir, size_t dir_len,
+                           const char *name, char suffix) {
+  size_t name_len = strlen(name);
+  char *s = malloc(line_len + dir_len + name_len + 2);
+  if (s == NULL)
+    return;
+  memcpy(s, line, line_len);
+  memcpy(s + line_len, dir, dir_len);
+  memcpy(s + line_len + dir_len, name, name_len);
+  s[line_len + dir_len + name_len] = suffix;
+  s[line_len + dir_len + name_len + 1] = '\0';
+  linenoiseAddCompletion(lc, s);
+  free(s);
+}
+
+static void complete_command(const char *buf, size_t start,
+                             linenoiseCompletions *lc) {
+  const char *word = buf + start;
+  size_t word_len = strlen(word);
+
+  path_index_update();
+  for (size_t i = lower_bound(commands, ncommands, word);
+       i < ncommands && lc->len < MAX_COMPLETIONS &&
+       strncmp(commands[i], word, word_len) == 0;
+       i++)
+    add_completion(lc, buf, start, "", 0, commands[i], ' ');
+}
+
+static void complete_file(const char *buf, size_t start,
+                          linenoiseCompletions *lc) {
+  const char *word = buf + start;
+  const char *slash = strrchr(word, '/');
+  size_t dir_len = slash ? (size_t)(slash - word) + 1 : 0;
+  const char *base = word + dir_len;
+  size_t base_len = strlen(base);
+
+  char *dir = dir_len ? strndup(word, dir_len) : strdup(".");
+  if (dir == NULL)
+    return;
+  struct dir_list *d = dir_lookup(dir);
+  if (d == NULL) {
+    free(dir);
+    return;
+  }
+
+  int dirfd = -1; // opened for the first link that needs following
+  for (size_t i = lower_bound(d->sorted, d->count, base);
+       i < d->count && lc->len < MAX_COMPLETIONS &&
+       strncmp(d->sorted[i], base, base_len) == 0;
+       i++) {
+    const char *name = d->sorted[i];
+    // Hidden files only when asked for
+    if (name[0] == '.' && base[0] != '.')
+      continue;
+
+    // Directories get a '/', so Tab can go on into them
+    unsigned char type = name[-1];
+    if (type == DT_LNK || type == DT_UNKNOWN) {
+      struct stat st;
+      if (dirfd == -1)
+        dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dirfd != -1 && fstatat(dirfd, name, &st, 0) == 0 &&
+          S_ISDIR(st.st_mode))
+        type = DT_DIR;
+    }
+    add_completion(lc, buf, start, word, dir_len, name,
+                   type == DT_DIR ? '/' : ' ');
+  }
+  if (dirfd != -1)
+    close(dirfd);
+  free(dir);
+}
+
+// linenoise completion callback. Completes the last word of the line: a
+// command name when it's the first word of a pipeline stage and has no
+// '/', a file name otherwise.
+void complete_line(const char *buf, linenoiseCompletions *lc) {
+  size_t len = strlen(buf);
+  size_t start = len;
+  while (start > 0 && strchr(" \t|<>&", buf[start - 1]) == NULL)
+    start--;
+
+  size_t p = start;
+  while (p > 0 && (buf[p - 1] == ' ' || buf[p - 1] == '\t'))
+    p--;
+  bool command_word = p == 0 || buf[p - 1] == '|';
+
+  if (command_word && strchr(buf + start, '/') == NULL)
+    complete_command(buf, start, lc);
+  else
+    complete_file(buf, start, lc);
+}
+
+// Drop every listing, e.g. for "hash -r"
+void complete_reset(void) {
+  path_index_free();
+  for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    dir_free(&dir_cache[i]);
+}
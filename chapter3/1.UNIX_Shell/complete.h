@@ -0,0 +1,13 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include "linenoise.h"
+
+// Tab completion: command names from an index of the executables in $PATH,
+// file names from cached directory listings. Both are read once and only
+// read again when a directory's mtime changes.
+
+void complete_line(const char *buf, linenoiseCompletions *lc);
+void complete_reset(void);
+
+#endif // COMPLETE_H
@@ -0,0 +1,154 @@
+#include "hash.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HASH_BUCKETS 64
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+struct hash_entry {
+  char *name;
+  char *path;
+  int hits;
+  struct hash_entry *next;
+};
+
+static struct hash_entry *buckets[HASH_BUCKETS];
+// PATH the table was filled with; a different PATH drops every entry.
+static char *hashed_path_env = NULL;
+
+// FNV-1a
+static unsigned int hash_name(const char *name) {
+  unsigned int h = 2166136261u;
+  for (; *name; name++) {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return h % HASH_BUCKETS;
+}
+
+static bool is_executable(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+         access(path, X_OK) == 0;
+}
+
+// Walk $PATH once and return a malloc'd absolute path, or NULL.
+static char *search_path(const char *name, const char *path_env) {
+  size_t name_len = strlen(name);
+  const char *dir = path_env;
+
+  while (dir != NULL) {
+    const char *end = strchr(dir, ':');
+    size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+    // An empty PATH entry means the current directory
+    const char *d = dir_len ? dir : ".";
+    size_t d_len = dir_len ? dir_len : 1;
+
+    char *candidate = malloc(d_len + name_len + 2);
+    if (candidate == NULL)
+      return NULL;
+    memcpy(candidate, d, d_len);
+    candidate[d_len] = '/';
+    memcpy(candidate + d_len + 1, name, name_len + 1);
+    if (is_executable(candidate))
+      return candidate;
+    free(candidate);
+
+    dir = end ? end + 1 : NULL;
+  }
+  return NULL;
+}
+
+void hash_reset(void) {
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    struct hash_entry *e = buckets[i];
+    while (e != NULL) {
+      struct hash_entry *next = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      e = next;
+    }
+    buckets[i] = NULL;
+  }
+  free(hashed_path_env);
+  hashed_path_env = NULL;
+}
+
+// Return the path to exec for 'name'. Names containing a '/' are used as
+// they are; anything else is resolved through the table, walking $PATH on a
+// miss. Returns NULL if the command can't be found.
+const char *hash_lookup(const char *name) {
+  if (strchr(name, '/') != NULL)
+    return name;
+
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = DEFAULT_PATH;
+  if (hashed_path_env == NULL || strcmp(hashed_path_env, path_env) != 0) {
+    hash_reset();
+    hashed_path_env = strdup(path_env);
+  }
+
+  unsigned int b = hash_name(name);
+  for (struct hash_entry *e = buckets[b]; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      e->hits++;
+      return e->path;
+    }
+  }
+
+  char *path = search_path(name, path_env);
+  if (path == NULL)
+    return NULL;
+
+  struct hash_entry *e = malloc(sizeof(*e));
+  if (e == NULL || (e->name = strdup(name)) == NULL) {
+    free(e);
+    free(path);
+    return NULL;
+  }
+  e->path = path;
+  e->hits = 1;
+  e->next = buckets[b];
+  buckets[b] = e;
+#ifdef DEBUG
+  printf("DEBUG: hashed %s -> %s\n", name, path);
+#endif
+  return e->path;
+}
+
+// Drop a single entry, e.g. after its binary was removed or moved.
+void hash_forget(const char *name) {
+  struct hash_entry **p = &buckets[hash_name(name)];
+  while (*p != NULL) {
+    if (strcmp((*p)->name, name) == 0) {
+      struct hash_entry *e = *p;
+      *p = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      return;
+    }
+    p = &(*p)->next;
+  }
+}
+
+void hash_print(void) {
+  bool empty = true;
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    for (struct hash_entry *e = buckets[i]; e != NULL; e = e->next) {
+      if (empty) {
+        printf("hits\tcommand\n");
+        empty = false;
+      }
+      printf("%4d\t%s\n", e->hits, e->path);
+    }
+  }
+  if (empty)
+    printf("hash: hash table empty\n");
+}
@@ -0,0 +1,12 @@
+#ifndef HASH_H
+#define HASH_H
+
+// Command hash table: remembers where in $PATH each command was found, so
+// the PATH walk happens once per command instead of once per exec.
+
+const char *hash_lookup(const char *name);
+void hash_forget(const char *name);
+void hash_reset(void);
+void hash_print(void);
+
+#endif // HASH_H
@@ -0,0 +1,551 @@
+#include "jobs.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PROC_BUCKETS 256
+
+static bool job_control = false; // interactive, with our own process group
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+
+// Jobs in order of id, and every live stage by pid so the SIGCHLD handler
+// can find what it reaped without walking the job list. Both are only
+// changed with SIGCHLD blocked.
+static struct job *job_head = NULL;
+static struct job *job_tail = NULL;
+static struct proc *proc_table[PROC_BUCKETS];
+
+// $? and $PIPESTATUS: the exit status of every stage of the last foreground
+// pipeline (a single entry after a builtin, a background job or an error)
+static int *pipestatus = NULL;
+static int pipestatus_len = 0;
+static int pipestatus_cap = 0;
+
+bool job_control_enabled(void) { return job_control; }
+
+void sigchld_block(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+}
+
+void sigchld_unblock(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+// Signals the interactive shell ignores; children get them back at their
+// default disposition.
+void job_default_signals(sigset_t *set) {
+  sigemptyset(set);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGQUIT);
+  sigaddset(set, SIGTSTP);
+  sigaddset(set, SIGTTIN);
+  sigaddset(set, SIGTTOU);
+}
+
+static struct proc **proc_slot(pid_t pid) {
+  struct proc **p = &proc_table[(unsigned int)pid % PROC_BUCKETS];
+  while (*p != NULL && (*p)->pid != pid)
+    p = &(*p)->hash_next;
+  return p;
+}
+
+static void proc_unhash(struct proc *proc) {
+  struct proc **p = proc_slot(proc->pid);
+  if (*p == proc)
+    *p = proc->hash_next;
+}
+
+// Record a status change reported by wait4(). Runs in the SIGCHLD handler
+// too, so it only touches the tables and never allocates or prints.
+static void update_proc(pid_t pid, int wstatus, const struct rusage *usage) {
+  struct proc *proc = *proc_slot(pid);
+  if (proc == NULL)
+    return;
+
+  if (WIFSTOPPED(wstatus)) {
+    proc->stopped = true;
+  } else if (WIFCONTINUED(wstatus)) {
+    proc->stopped = false;
+  } else {
+    proc->done = true;
+    proc->stopped = false;
+    proc->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus)
+                                      : 128 + WTERMSIG(wstatus);
+    proc->usage = *usage;
+    clock_gettime(CLOCK_MONOTONIC, &proc->end);
+    proc->job->live--;
+    proc_unhash(proc);
+  }
+}
+
+// Reap whatever has changed state, so background jobs never linger as
+// zombies. Foreground waits block SIGCHLD and use waitpid() on the job's
+// own process group instead.
+static void sigchld_handler(int sig) {
+  int saved_errno = errno;
+  pid_t pid;
+  int wstatus;
+  struct rusage usage;
+
+  (void)sig;
+  while ((pid = wait4(-1, &wstatus, WNOHANG | WUNTRACED | WCONTINUED,
+                      &usage)) > 0)
+    update_proc(pid, wstatus, &usage);
+  errno = saved_errno;
+}
+
+void jobs_init(bool interactive) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigchld_handler;
+  sigemptyset(&sa.sa_mask);
+  // SA_RESTART keeps linenoise's read() from failing when a job finishes
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  if (!interactive || !isatty(STDIN_FILENO))
+    return;
+
+  // Wait until we are in the foreground, then take the terminal for our own
+  // process group.
+  while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+    kill(-shell_pgid, SIGTTIN);
+
+  sigset_t ignored;
+  job_default_signals(&ignored);
+  for (int sig = 1; sig < NSIG; sig++)
+    if (sigismember(&ignored, sig) == 1)
+      signal(sig, SIG_IGN);
+
+  shell_pgid = getpid();
+  if (setpgid(shell_pgid, shell_pgid) == -1 && errno != EPERM) {
+    perror("setpgid");
+    return;
+  }
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  tcgetattr(STDIN_FILENO, &shell_tmodes);
+  job_control = true;
+}
+
+// Allocate a job for a pipeline of 'nprocs' stages. Its stages are filled in
+// with job_set_proc() as they are started.
+struct job *job_new(const char *command, int nprocs, bool timed) {
+  struct job *job = calloc(1, sizeof(*job));
+  if (job == NULL)
+    return NULL;
+  job->procs = calloc(nprocs, sizeof(struct proc));
+  job->command = strdup(command);
+  if (job->procs == NULL || job->command == NULL) {
+    free(job->procs);
+    free(job->command);
+    free(job);
+    return NULL;
+  }
+  job->nprocs = nprocs;
+  job->timed = timed;
+  return job;
+}
+
+// Record stage 'i', running 'name'. 'pid' is -1 for a stage that could not
+// be started, in which case 'status' is its exit status. Call with SIGCHLD
+// blocked.
+void job_set_proc(struct job *job, int i, const char *name, pid_t pid,
+                  int status) {
+  struct proc *proc = &job->procs[i];
+  proc->pid = pid;
+  proc->job = job;
+  if (job->timed)
+    proc->name = strdup(name);
+  if (pid == -1) {
+    proc->done = true;
+    proc->status = status;
+    return;
+  }
+  if (job->pgid == 0)
+    job->pgid = pid;
+  job->live++;
+  clock_gettime(CLOCK_MONOTONIC, &proc->start);
+  proc->hash_next = proc_table[(unsigned int)pid % PROC_BUCKETS];
+  proc_table[(unsigned int)pid % PROC_BUCKETS] = proc;
+}
+
+// Add the job to the job table. Call with SIGCHLD blocked.
+void job_register(struct job *job) {
+  job->id = job_tail != NULL ? job_tail->id + 1 : 1;
+  if (job_tail != NULL)
+    job_tail->next = job;
+  else
+    job_head = job;
+  job_tail = job;
+}
+
+// Remove the job from the table and free it. Call with SIGCHLD blocked.
+void job_discard(struct job *job) {
+  struct job *prev = NULL;
+  for (struct job *j = job_head; j != NULL; prev = j, j = j->next) {
+    if (j != job)
+      continue;
+    if (prev != NULL)
+      prev->next = j->next;
+    else
+      job_head = j->next;
+    if (job_tail == j)
+      job_tail = prev;
+    break;
+  }
+  for (int i = 0; i < job->nprocs; i++) {
+    if (job->procs[i].pid != -1 && !job->procs[i].done)
+      proc_unhash(&job->procs[i]);
+    free(job->procs[i].name);
+  }
+  free(job->procs);
+  free(job->command);
+  free(job);
+}
+
+static bool job_is_stopped(struct job *job) {
+  for (int i = 0; i < job->nprocs; i++)
+    if (job->procs[i].stopped)
+      return true;
+  return false;
+}
+
+// The job's exit status is its last stage's
+static int job_status(struct job *job) {
+  return job->procs[job->nprocs - 1].status;
+}
+
+void jobs_set_status(int status) {
+  if (pipestatus_cap == 0) {
+    pipestatus = malloc(sizeof(int));
+    if (pipestatus == NULL)
+      return;
+    pipestatus_cap = 1;
+  }
+  pipestatus[0] = status;
+  pipestatus_len = 1;
+}
+
+// Set $PIPESTATUS (and $?) from a finished job
+void job_save_status(struct job *job) {
+  if (pipestatus_cap < job->nprocs) {
+    int *p = realloc(pipestatus, job->nprocs * sizeof(int));
+    if (p == NULL) {
+      jobs_set_status(job_status(job));
+      return;
+    }
+    pipestatus = p;
+    pipestatus_cap = job->nprocs;
+  }
+  for (int i = 0; i < job->nprocs; i++)
+    pipestatus[i] = job->procs[i].status;
+  pipestatus_len = job->nprocs;
+}
+
+int jobs_last_status(void) {
+  return pipestatus_len > 0 ? pipestatus[pipestatus_len - 1] : 0;
+}
+
+const int *jobs_pipestatus(int *len) {
+  *len = pipestatus_len;
+  return pipestatus;
+}
+
+static double timeval_secs(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// The "time" report: wall clock, user and system time and peak resident set
+// of every stage, so a slow pipeline shows which stage the time went to.
+// Stages that never started show zeros.
+static void print_times(struct job *job) {
+  fprintf(stderr, "%-5s %-16s %10s %10s %10s %10s\n", "stage", "command",
+          "real", "user", "sys", "maxrss");
+  for (int i = 0; i < job->nprocs; i++) {
+    struct proc *proc = &job->procs[i];
+    double real = (proc->end.tv_sec - proc->start.tv_sec) +
+                  (proc->end.tv_nsec - proc->start.tv_nsec) / 1e9;
+    fprintf(stderr, "%-5d %-16s %9.3fs %9.3fs %9.3fs %7ld KB\n", i + 1,
+            proc->name != NULL ? proc->name : "?", real,
+            timeval_secs(proc->usage.ru_utime),
+            timeval_secs(proc->usage.ru_stime), proc->usage.ru_maxrss);
+  }
+}
+
+static const char *job_state(struct job *job, char *buf, size_t len) {
+  if (job->live > 0)
+    return job_is_stopped(job) ? "Stopped" : "Running";
+  if (job_status(job) == 0)
+    return "Done";
+  snprintf(buf, len, "Exit %d", job_status(job));
+  return buf;
+}
+
+static void print_job(struct job *job) {
+  char buf[32];
+  printf("[%d]%c  %-22s %s\n", job->id, job == job_tail ? '+' : ' ',
+         job_state(job, buf, sizeof(buf)), job->command);
+}
+
+// Block until the job finishes or stops. Call with SIGCHLD blocked so the
+// handler can't reap the job's processes first.
+static void wait_job(struct job *job) {
+  while (job->live > 0 && !job_is_stopped(job)) {
+    pid_t target = job->pgid;
+    int wstatus;
+
+    if (job_control) {
+      target = -job->pgid;
+    } else {
+      // No process groups of our own: wait for the job's stages one by one
+      for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pid != -1 && !job->procs[i].done) {
+          target = job->procs[i].pid;
+          break;
+        }
+      }
+    }
+
+    struct rusage usage;
+    pid_t pid = wait4(target, &wstatus, WUNTRACED, &usage);
+    if (pid == -1) {
+      if (errno == EINTR)
+        continue;
+      // Nothing left to wait for: don't keep the job around forever
+      for (int i = 0; i < job->nprocs; i++) {
+        struct proc *proc = &job->procs[i];
+        if (proc->pid != -1 && !proc->done) {
+          proc_unhash(proc);
+          proc->done = true;
+          proc->stopped = false;
+          proc->status = 127;
+        }
+      }
+      job->live = 0;
+      break;
+    }
+    update_proc(pid, wstatus, &usage);
+  }
+}
+
+static void continue_job(struct job *job) {
+  for (int i = 0; i < job->nprocs; i++)
+    job->procs[i].stopped = false;
+  job->notified = false;
+  if (job_control)
+    kill(-job->pgid, SIGCONT);
+  else
+    for (int i = 0; i < job->nprocs; i++)
+      if (job->procs[i].pid != -1 && !job->procs[i].done)
+        kill(job->procs[i].pid, SIGCONT);
+}
+
+// Run the job in the foreground: give it the terminal, optionally send it
+// SIGCONT, and wait for it to finish or stop. A finished job is removed from
+// the table and its stages' statuses become $PIPESTATUS. Returns the job's
+// exit status (128+SIGTSTP if it stopped).
+int job_foreground(struct job *job, bool cont) {
+  int status;
+
+  sigchld_block();
+  if (job_control) {
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+    if (cont)
+      tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+  }
+  if (cont)
+    continue_job(job);
+
+  wait_job(job);
+
+  if (job_control) {
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    if (job->live > 0)
+      tcgetattr(STDIN_FILENO, &job->tmodes);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+  }
+
+  if (job->live > 0) {
+    printf("\n");
+    print_job(job);
+    job->notified = true;
+    status = 128 + SIGTSTP;
+    jobs_set_status(status);
+  } else {
+    status = job_status(job);
+    // Ctrl+C: the prompt should start on a fresh line
+    if (job_control && status == 128 + SIGINT)
+      printf("\n");
+    if (job->timed)
+      print_times(job);
+    job_save_status(job);
+    job_discard(job);
+  }
+  sigchld_unblock();
+  return status;
+}
+
+// Leave the job running in the background, optionally sending it SIGCONT.
+void job_background(struct job *job, bool cont) {
+  sigchld_block();
+  if (cont) {
+    continue_job(job);
+    printf("[%d]%c %s &\n", job->id, job == job_tail ? '+' : ' ',
+           job->command);
+  } else if (job_control) {
+    printf("[%d] %d\n", job->id, job->pgid);
+  }
+  sigchld_unblock();
+}
+
+// Report (when interactive) and drop jobs that finished since the last
+// call, and report jobs that stopped in the background.
+void jobs_notify(void) {
+  sigchld_block();
+  struct job *job = job_head;
+  while (job != NULL) {
+    struct job *next = job->next;
+    if (job->live == 0) {
+      if (job_control)
+        print_job(job);
+      if (job->timed)
+        print_times(job);
+      job_discard(job);
+    } else if (job_is_stopped(job) && !job->notified) {
+      print_job(job);
+      job->notified = true;
+    }
+    job = next;
+  }
+  sigchld_unblock();
+}
+
+// Find a job from a "%N" spec (or a plain job number); NULL spec means the
+// most recent job.
+static struct job *find_job(const char *name, const char *spec) {
+  if (spec == NULL) {
+    if (job_tail == NULL)
+      printf("%s: no current job\n", name);
+    return job_tail;
+  }
+
+  const char *p = spec[0] == '%' ? spec + 1 : spec;
+  char *end;
+  long id = strtol(p, &end, 10);
+  if (*p != '\0' && *end == '\0') {
+    for (struct job *job = job_head; job != NULL; job = job->next)
+      if (job->id == id)
+        return job;
+  }
+  printf("%s: %s: no such job\n", name, spec);
+  return NULL;
+}
+
+// wait's operands: "%N" is a job, a plain number is a pid
+static struct job *find_wait_job(const char *spec) {
+  if (spec[0] == '%')
+    return find_job("wait", spec);
+
+  char *end;
+  long pid = strtol(spec, &end, 10);
+  if (*spec != '\0' && *end == '\0') {
+    struct proc *proc = *proc_slot((pid_t)pid);
+    if (proc != NULL)
+      return proc->job;
+  }
+  printf("wait: pid %s is not a child of this shell\n", spec);
+  return NULL;
+}
+
+// Wait for a job in the background sense (no terminal hand-over) and drop it
+// if it finished. Call with SIGCHLD blocked.
+static int wait_for(struct job *job) {
+  wait_job(job);
+  if (job->live > 0)
+    return 128 + SIGTSTP;
+  int status = job_status(job);
+  if (job->timed)
+    print_times(job);
+  job_discard(job);
+  return status;
+}
+
+// The jobs, fg, bg and wait builtins (see builtins.c). Each returns its
+// exit status.
+int builtin_jobs(char **argv) {
+  (void)argv;
+  sigchld_block();
+  struct job *job = job_head;
+  while (job != NULL) {
+    struct job *next = job->next;
+    print_job(job);
+    if (job->live == 0) {
+      if (job->timed)
+        print_times(job);
+      job_discard(job);
+    }
+    else if (job_is_stopped(job))
+      job->notified = true;
+    job = next;
+  }
+  sigchld_unblock();
+  return 0;
+}
+
+static int fg_bg(char **argv, bool foreground) {
+  const char *name = argv[0];
+
+  if (!job_control) {
+    printf("%s: no job control\n", name);
+    return 1;
+  }
+  sigchld_block();
+  struct job *job = find_job(name, argv[1]);
+  sigchld_unblock();
+  if (job == NULL)
+    return 1;
+  if (foreground) {
+    printf("%s\n", job->command);
+    fflush(stdout);
+    return job_foreground(job, true);
+  }
+  job_background(job, true);
+  return 0;
+}
+
+int builtin_fg(char **argv) { return fg_bg(argv, true); }
+
+int builtin_bg(char **argv) { return fg_bg(argv, false); }
+
+int builtin_wait(char **argv) {
+  int status = 0;
+  sigchld_block();
+  if (argv[1] == NULL) {
+    // Wait for every job; jobs that stop stay in the table
+    struct job *job = job_head;
+    while (job != NULL) {
+      struct job *next = job->next;
+      wait_for(job);
+      job = next;
+    }
+  } else {
+    for (int i = 1; argv[i] != NULL; i++) {
+      struct job *job = find_wait_job(argv[i]);
+      status = job != NULL ? wait_for(job) : 127;
+    }
+  }
+  sigchld_unblock();
+  return status;
+}
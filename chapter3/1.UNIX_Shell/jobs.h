@@ -0,0 +1,65 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <termios.h>
+#include <time.h>
+
+// One process (pipeline stage) of a job
+struct proc {
+  pid_t pid;     // -1 if the stage could not be started
+  int status;    // shell-style exit status once done
+  bool done;     // exited, was killed, or never started
+  bool stopped;  // stopped by a signal (Ctrl+Z, SIGTTIN, ...)
+  char *name;    // argv[0], kept for the "time" report only
+  struct timespec start, end; // CLOCK_MONOTONIC, spawn and reap
+  struct rusage usage;        // from wait4() once done
+  struct job *job;
+  struct proc *hash_next; // chain in the pid -> proc table
+};
+
+// A pipeline, tracked by its process group until every stage is reaped
+struct job {
+  int id;        // the N in %N
+  pid_t pgid;    // process group (the first stage's pid)
+  char *command; // command line, for jobs/fg/bg output
+  struct proc *procs;
+  int nprocs;
+  int live; // stages not yet reaped
+  bool notified;
+  bool timed; // "time" prefix: report every stage's usage when done
+  struct termios tmodes; // terminal modes saved when the job stopped
+  struct job *next;
+};
+
+void jobs_init(bool interactive);
+bool job_control_enabled(void);
+void sigchld_block(void);
+void sigchld_unblock(void);
+void job_default_signals(sigset_t *set);
+
+struct job *job_new(const char *command, int nprocs, bool timed);
+void job_set_proc(struct job *job, int i, const char *name, pid_t pid,
+                  int status);
+void job_register(struct job *job);
+void job_discard(struct job *job);
+int job_foreground(struct job *job, bool cont);
+void job_background(struct job *job, bool cont);
+void jobs_notify(void);
+
+// Job control builtins, run through builtins.c
+int builtin_jobs(char **argv);
+int builtin_fg(char **argv);
+int builtin_bg(char **argv);
+int builtin_wait(char **argv);
+
+// $? and $PIPESTATUS
+void jobs_set_status(int status);
+void job_save_status(struct job *job);
+int jobs_last_status(void);
+const int *jobs_pipestatus(int *len);
+
+#endif // JOBS_H
@@ -106,17 +106,24 @@
 #include "linenoise.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
+/* In append mode the history file is compacted back to the last
+ * history_max_len lines once it holds this many times as many. */
+#define LINENOISE_HISTORY_COMPACT_FACTOR 2
 #define LINENOISE_MAX_LINE 4096
 static char *unsupported_term[] = {"dumb", "cons25", "emacs", NULL};
 static linenoiseCompletionCallback *completionCallback = NULL;
@@ -126,15 +133,39 @@ static char *linenoiseNoTTY(void);
 static void refreshLineWithCompletion(struct linenoiseState *ls,
                                       linenoiseCompletions *lc, int flags);
 static void refreshLineWithFlags(struct linenoiseState *l, int flags);
+static char **historySlot(int i);
+static void historyFree(char *line);
+static long historySearch(const char *query, long before);
+static const char *historyEntry(long seq);
+static void historyIndex(const char *line, long seq);
+static void freeTrigrams(void);
+static void prefixIndex(const char *line, long seq);
+static void freePrefixIndex(void);
 
 static struct termios orig_termios; /* In order to restore at exit.*/
 static int maskmode = 0; /* Show "***" instead of input. For passwords. */
 static int rawmode = 0; /* For atexit() function to check if restore is needed*/
+static int rawmode_ofd = STDOUT_FILENO; /* Terminal bracketed paste was
+                                         * enabled on, to disable it. */
 static int mlmode = 0;  /* Multi line mode. Default is single line. */
+/* Test mode: when LINENOISE_FULL_REFRESH is set, every refresh rewrites the
+ * whole line instead of what changed (see refreshDiff()), to compare the
+ * two. */
+static int full_refresh = 0;
 static int atexit_registered = 0; /* Register atexit just 1 time. */
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
 static int history_len = 0;
+static int history_start = 0; /* Slot of the oldest entry. */
+static long history_seq = 0;  /* Sequence number of the oldest entry. */
 static char **history = NULL;
+/* Lines read by linenoiseHistoryLoad() share one allocation; it is freed
+ * when the last of them leaves the history. */
+static char *history_block = NULL;
+static size_t history_block_size = 0;
+static int history_block_refs = 0;
+static int history_fd = -1;         /* History file in append mode, or -1. */
+static char *history_file = NULL;   /* Its name, for compaction. */
+static long history_file_lines = 0; /* Lines in it, as far as we know. */
 
 /* =========================== UTF-8 support ================================ */
 
@@ -357,67 +388,122 @@ static size_t utf8NextCharLen(const char *buf, size_t pos, size_t len) {
   return total;
 }
 
-/* Return the display width of a Unicode codepoint. This is a heuristic
- * that works for most common cases:
+/* Display widths of codepoints that aren't one column wide. This is a
+ * heuristic that works for most common cases:
  * - Control chars and zero-width: 0 columns
  * - Grapheme-extending chars (VS, skin tone, ZWJ): 0 columns
- * - ASCII printable: 1 column
  * - Wide chars (CJK, emoji, fullwidth): 2 columns
  * - Everything else: 1 column
  *
  * This is not a full wcwidth() implementation, but a minimal heuristic
- * that handles emoji and CJK characters reasonably well. */
-static int utf8CharWidth(uint32_t cp) {
-  /* Control characters and combining marks: zero width. */
-  if (cp < 32 || (cp >= 0x7F && cp < 0xA0))
-    return 0;
-  if (isCombiningMark(cp))
-    return 0;
+ * that handles emoji and CJK characters reasonably well. Later entries
+ * override earlier ones. */
+static const struct {
+  uint32_t first, last;
+  unsigned char width;
+} width_ranges[] = {
+    /* Wide character ranges - these display as 2 columns:
+     * - CJK Unified Ideographs and Extensions
+     * - Fullwidth forms
+     * - Various emoji ranges */
+    {0x1100, 0x115F, 2},   /* Hangul Jamo */
+    {0x231A, 0x231B, 2},   /* Watch, Hourglass */
+    {0x2329, 0x232A, 2},   /* Angle brackets */
+    {0x23E9, 0x23F3, 2},   /* Various symbols */
+    {0x23F8, 0x23FA, 2},   /* Various symbols */
+    {0x25AA, 0x25AB, 2},   /* Small squares */
+    {0x25B6, 0x25C0, 2},   /* Play/reverse buttons */
+    {0x25FB, 0x25FE, 2},   /* Squares */
+    {0x2600, 0x26FF, 2},   /* Misc Symbols (sun, cloud, etc) */
+    {0x2700, 0x27BF, 2},   /* Dingbats (❤, ✂, etc) */
+    {0x2934, 0x2935, 2},   /* Arrows */
+    {0x2B05, 0x2B07, 2},   /* Arrows */
+    {0x2B1B, 0x2B1C, 2},   /* Squares */
+    {0x2B50, 0x2B50, 2},   /* Star */
+    {0x2B55, 0x2B55, 2},   /* Circle */
+    {0x2E80, 0x303E, 2},   /* CJK ... */
+    {0x3040, 0xA4CF, 2},   /* ... Yi */
+    {0xAC00, 0xD7A3, 2},   /* Hangul Syllables */
+    {0xF900, 0xFAFF, 2},   /* CJK Compatibility Ideographs */
+    {0xFE10, 0xFE1F, 2},   /* Vertical forms */
+    {0xFE30, 0xFE6F, 2},   /* CJK Compatibility Forms */
+    {0xFF00, 0xFF60, 2},   /* Fullwidth Forms */
+    {0xFFE0, 0xFFE6, 2},   /* Fullwidth Signs */
+    {0x1F1E6, 0x1F1FF, 2}, /* Regional Indicators (flags) */
+    {0x1F300, 0x1F64F, 2}, /* Misc Symbols and Emoticons */
+    {0x1F680, 0x1F6FF, 2}, /* Transport and Map Symbols */
+    {0x1F900, 0x1F9FF, 2}, /* Supplemental Symbols */
+    {0x1FA00, 0x1FAFF, 2}, /* Chess, Extended-A */
+    {0x20000, 0x2FFFF, 2}, /* CJK Extension B and beyond */
+    /* Control characters and combining marks: zero width. */
+    {0x0000, 0x001F, 0},
+    {0x007F, 0x009F, 0},
+    {0x0300, 0x036F, 0}, /* Combining Diacriticals */
+    {0x1AB0, 0x1AFF, 0}, /* Combining Diacriticals Extended */
+    {0x1DC0, 0x1DFF, 0}, /* Combining Diacriticals Supplement */
+    {0x20D0, 0x20FF, 0}, /* Combining Diacriticals for Symbols */
+    {0xFE20, 0xFE2F, 0}, /* Combining Half Marks */
+    /* Grapheme-extending characters: zero width.
+     * These modify the preceding character rather than taking space. */
+    {0x200D, 0x200D, 0},   /* Zero Width Joiner */
+    {0xFE0E, 0xFE0F, 0},   /* Variation selectors */
+    {0x1F3FB, 0x1F3FF, 0}, /* Skin tone modifiers */
+};
 
-  /* Grapheme-extending characters: zero width.
-   * These modify the preceding character rather than taking space. */
-  if (isVariationSelector(cp))
-    return 0;
-  if (isSkinToneModifier(cp))
-    return 0;
-  if (isZWJ(cp))
-    return 0;
+#define WIDTH_RANGES (sizeof(width_ranges) / sizeof(width_ranges[0]))
+#define WIDTH_PAGE_BITS 8
+#define WIDTH_PAGE (1 << WIDTH_PAGE_BITS)
+#define WIDTH_PAGES (0x30000 >> WIDTH_PAGE_BITS) /* Everything above: 1. */
+/* Only pages holding the end of a range differ from the three uniform
+ * ones, so this many blocks are always enough. */
+#define WIDTH_MAX_BLOCKS (2 * WIDTH_RANGES + 3)
+
+/* Two-level table built from width_ranges[] on first use: width_page[]
+ * maps each 256-codepoint page to a block of 2-bit widths, and pages with
+ * the same widths (most of them) share a block. */
+static unsigned char width_page[WIDTH_PAGES];
+static unsigned char width_block[WIDTH_MAX_BLOCKS][WIDTH_PAGE / 4];
+static int width_blocks = 0;
+
+static void widthTableInit(void) {
+  for (int page = 0; page < WIDTH_PAGES; page++) {
+    uint32_t base = (uint32_t)page << WIDTH_PAGE_BITS;
+    unsigned char w[WIDTH_PAGE], block[WIDTH_PAGE / 4];
+
+    memset(w, 1, sizeof(w));
+    for (size_t r = 0; r < WIDTH_RANGES; r++) {
+      uint32_t first = width_ranges[r].first, last = width_ranges[r].last;
+      if (last < base || first >= base + WIDTH_PAGE)
+        continue;
+      for (uint32_t cp = first < base ? base : first;
+           cp <= last && cp < base + WIDTH_PAGE; cp++)
+        w[cp - base] = width_ranges[r].width;
+    }
+    memset(block, 0, sizeof(block));
+    for (int i = 0; i < WIDTH_PAGE; i++)
+      block[i / 4] |= w[i] << (i % 4 * 2);
+
+    int b = 0;
+    while (b < width_blocks && memcmp(width_block[b], block, sizeof(block)))
+      b++;
+    if (b == width_blocks)
+      memcpy(width_block[width_blocks++], block, sizeof(block));
+    width_page[page] = b;
+  }
+}
 
-  /* Wide character ranges - these display as 2 columns:
-   * - CJK Unified Ideographs and Extensions
-   * - Fullwidth forms
-   * - Various emoji ranges */
-  if (cp >= 0x1100 &&
-      (cp <= 0x115F ||                   /* Hangul Jamo */
-       cp == 0x2329 || cp == 0x232A ||   /* Angle brackets */
-       (cp >= 0x231A && cp <= 0x231B) || /* Watch, Hourglass */
-       (cp >= 0x23E9 && cp <= 0x23F3) || /* Various symbols */
-       (cp >= 0x23F8 && cp <= 0x23FA) || /* Various symbols */
-       (cp >= 0x25AA && cp <= 0x25AB) || /* Small squares */
-       (cp >= 0x25B6 && cp <= 0x25C0) || /* Play/reverse buttons */
-       (cp >= 0x25FB && cp <= 0x25FE) || /* Squares */
-       (cp >= 0x2600 && cp <= 0x26FF) || /* Misc Symbols (sun, cloud, etc) */
-       (cp >= 0x2700 && cp <= 0x27BF) || /* Dingbats (❤, ✂, etc) */
-       (cp >= 0x2934 && cp <= 0x2935) || /* Arrows */
-       (cp >= 0x2B05 && cp <= 0x2B07) || /* Arrows */
-       (cp >= 0x2B1B && cp <= 0x2B1C) || /* Squares */
-       cp == 0x2B50 || cp == 0x2B55 ||   /* Star, circle */
-       (cp >= 0x2E80 && cp <= 0xA4CF && cp != 0x303F) || /* CJK ... Yi */
-       (cp >= 0xAC00 && cp <= 0xD7A3) ||                 /* Hangul Syllables */
-       (cp >= 0xF900 && cp <= 0xFAFF) ||   /* CJK Compatibility Ideographs */
-       (cp >= 0xFE10 && cp <= 0xFE1F) ||   /* Vertical forms */
-       (cp >= 0xFE30 && cp <= 0xFE6F) ||   /* CJK Compatibility Forms */
-       (cp >= 0xFF00 && cp <= 0xFF60) ||   /* Fullwidth Forms */
-       (cp >= 0xFFE0 && cp <= 0xFFE6) ||   /* Fullwidth Signs */
-       (cp >= 0x1F1E6 && cp <= 0x1F1FF) || /* Regional Indicators (flags) */
-       (cp >= 0x1F300 && cp <= 0x1F64F) || /* Misc Symbols and Emoticons */
-       (cp >= 0x1F680 && cp <= 0x1F6FF) || /* Transport and Map Symbols */
-       (cp >= 0x1F900 && cp <= 0x1F9FF) || /* Supplemental Symbols */
-       (cp >= 0x1FA00 && cp <= 0x1FAFF) || /* Chess, Extended-A */
-       (cp >= 0x20000 && cp <= 0x2FFFF)))  /* CJK Extension B and beyond */
-    return 2;
-
-  return 1; /* Default: single width */
+/* Return the display width of a Unicode codepoint. */
+static int utf8CharWidth(uint32_t cp) {
+  if (cp >= 0x20 && cp < 0x7F)
+    return 1; /* ASCII printable */
+  if (cp >= 0x30000)
+    return 1;
+  if (width_blocks == 0)
+    widthTableInit();
+  unsigned int i = cp & (WIDTH_PAGE - 1);
+  return width_block[width_page[cp >> WIDTH_PAGE_BITS]][i / 4] >>
+             (i % 4 * 2) &
+         3;
 }
 
 /* Calculate the display width of a UTF-8 string of 'len' bytes.
@@ -460,6 +546,78 @@ static int utf8SingleCharWidth(const char *s, size_t len) {
   return utf8CharWidth(cp);
 }
 
+/* Return the start of the UTF-8 character before byte 'pos', or 0. */
+static size_t utf8PrevCharStart(const char *buf, size_t pos) {
+  while (pos > 0 && ((unsigned char)buf[--pos] & 0xC0) == 0x80)
+    ;
+  return pos;
+}
+
+/* ======================= Display width bookkeeping ========================
+ *
+ * The state keeps the display width of the prompt, of the line, and of the
+ * line up to the cursor, so a refresh doesn't measure them again. Edits and
+ * cursor moves only measure the text around them: starting at the
+ * character before, whose width they can't change, and for edits ending
+ * after the character that follows, which becomes joined or unjoined when a
+ * ZWJ is inserted or removed in front of it. */
+
+/* Set the prompt and measure it. */
+static void editSetPrompt(struct linenoiseState *l, const char *prompt,
+                          size_t plen) {
+  l->prompt = prompt;
+  l->plen = plen;
+  l->pwidth = utf8StrWidth(prompt, plen);
+}
+
+/* Measure the whole line again, after it was replaced. */
+static void editSync(struct linenoiseState *l) {
+  l->lencol = utf8StrWidth(l->buf, l->len);
+  l->poscol = utf8StrWidth(l->buf, l->pos);
+}
+
+/* Move the cursor to byte 'pos'. */
+static void editSetPos(struct linenoiseState *l, size_t pos) {
+  if (pos == 0) {
+    l->poscol = 0;
+  } else if (pos == l->len) {
+    l->poscol = l->lencol;
+  } else {
+    size_t from = utf8PrevCharStart(l->buf, pos < l->pos ? pos : l->pos);
+    l->poscol = l->poscol - utf8StrWidth(l->buf + from, l->pos - from) +
+                utf8StrWidth(l->buf + from, pos - from);
+  }
+  l->pos = pos;
+}
+
+/* Replace the 'del' bytes at 'at' with the 'ins' bytes at 's'. A cursor at
+ * or in the replaced bytes ends up after the new ones. The caller checks
+ * that the result fits the buffer. */
+static void editReplace(struct linenoiseState *l, size_t at, size_t del,
+                        const char *s, size_t ins) {
+  size_t from = utf8PrevCharStart(l->buf, at);
+  size_t end = at + del;
+  if (end < l->len)
+    end += utf8ByteLen(l->buf[end]);
+  if (end > l->len)
+    end = l->len;
+  size_t oldwidth = utf8StrWidth(l->buf + from, end - from);
+  int moved = l->pos >= at;
+  size_t oldcol = moved ? utf8StrWidth(l->buf + from, l->pos - from) : 0;
+
+  memmove(l->buf + at + ins, l->buf + at + del, l->len - at - del);
+  if (ins)
+    memcpy(l->buf + at, s, ins);
+  l->len = l->len - del + ins;
+  l->buf[l->len] = '\0';
+  end = end - del + ins;
+  l->lencol = l->lencol - oldwidth + utf8StrWidth(l->buf + from, end - from);
+  if (moved) {
+    l->pos = at + ins;
+    l->poscol = l->poscol - oldcol + utf8StrWidth(l->buf + from, l->pos - from);
+  }
+}
+
 enum KEY_ACTION {
   KEY_NULL = 0,   /* NULL */
   CTRL_A = 1,     /* Ctrl+a */
@@ -468,6 +626,7 @@ enum KEY_ACTION {
   CTRL_D = 4,     /* Ctrl-d */
   CTRL_E = 5,     /* Ctrl-e */
   CTRL_F = 6,     /* Ctrl-f */
+  CTRL_G = 7,     /* Ctrl-g */
   CTRL_H = 8,     /* Ctrl-h */
   TAB = 9,        /* Tab */
   CTRL_K = 11,    /* Ctrl+k */
@@ -475,6 +634,7 @@ enum KEY_ACTION {
   ENTER = 13,     /* Enter */
   CTRL_N = 14,    /* Ctrl-n */
   CTRL_P = 16,    /* Ctrl-p */
+  CTRL_R = 18,    /* Ctrl-r */
   CTRL_T = 20,    /* Ctrl-t */
   CTRL_U = 21,    /* Ctrl+u */
   CTRL_W = 23,    /* Ctrl+w */
@@ -483,7 +643,7 @@ enum KEY_ACTION {
 };
 
 static void linenoiseAtExit(void);
-int linenoiseHistoryAdd(const char *line);
+static int historyAdd(const char *line);
 #define REFRESH_CLEAN (1 << 0) // Clean the old prompt from the screen
 #define REFRESH_WRITE (1 << 1) // Rewrite the prompt on the screen.
 #define REFRESH_ALL (REFRESH_CLEAN | REFRESH_WRITE) // Do both.
@@ -537,7 +697,7 @@ static int isUnsupportedTerm(void) {
 }
 
 /* Raw mode: 1960 magic shit. */
-static int enableRawMode(int fd) {
+static int enableRawMode(int fd, int ofd) {
   struct termios raw;
 
   /* Test mode: when LINENOISE_ASSUME_TTY is set, skip terminal setup.
@@ -576,6 +736,10 @@ static int enableRawMode(int fd) {
   if (tcsetattr(fd, TCSAFLUSH, &raw) < 0)
     goto fatal;
   rawmode = 1;
+  /* Ask the terminal to bracket pasted text, see linenoiseEditPaste(). */
+  rawmode_ofd = ofd;
+  if (write(ofd, "\x1b[?2004h", 8) == -1) {
+  }
   return 0;
 
 fatal:
@@ -590,6 +754,8 @@ static void disableRawMode(int fd) {
     return;
   }
   /* Don't even check the return value as it's too late. */
+  if (rawmode && write(rawmode_ofd, "\x1b[?2004l", 8) == -1) {
+  }
   if (rawmode && tcsetattr(fd, TCSAFLUSH, &orig_termios) != -1)
     rawmode = 0;
 }
@@ -712,10 +878,13 @@ static void refreshLineWithCompletion(struct linenoiseState *ls,
     struct linenoiseState saved = *ls;
     ls->len = ls->pos = strlen(lc->cvec[ls->completion_idx]);
     ls->buf = lc->cvec[ls->completion_idx];
+    editSync(ls);
     refreshLineWithFlags(ls, flags);
     ls->len = saved.len;
     ls->pos = saved.pos;
     ls->buf = saved.buf;
+    ls->lencol = saved.lencol;
+    ls->poscol = saved.poscol;
   } else {
     refreshLineWithFlags(ls, flags);
   }
@@ -774,6 +943,7 @@ static int completeLine(struct linenoiseState *ls, int keypressed) {
         nwritten =
             snprintf(ls->buf, ls->buflen, "%s", lc.cvec[ls->completion_idx]);
         ls->len = ls->pos = nwritten;
+        editSync(ls);
       }
       ls->in_completion = 0;
       break;
@@ -834,35 +1004,55 @@ void linenoiseAddCompletion(linenoiseCompletions *lc, const char *str) {
 /* We define a very simple "append buffer" structure, that is an heap
  * allocated string where we can append to. This is useful in order to
  * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
+ * output in a single call, to avoid flickering effects.
+ *
+ * The buffers used by a refresh live in the linenoiseState and are reused
+ * by the next one (see abReuse()), and they grow by doubling, so once they
+ * are big enough for the line a refresh doesn't allocate at all. */
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 
-static void abInit(struct abuf *ab) {
-  ab->b = NULL;
+/* Start an empty append buffer on top of 'b', an allocation of 'cap' bytes
+ * (or NULL) kept from an earlier refresh. */
+static void abReuse(struct abuf *ab, char *b, size_t cap) {
+  ab->b = b;
   ab->len = 0;
+  ab->cap = cap;
 }
 
 static void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL)
-    return;
-  memcpy(new + ab->len, s, len);
-  ab->b = new;
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 64;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(ab->b + ab->len, s, len);
   ab->len += len;
 }
 
-static void abFree(struct abuf *ab) { free(ab->b); }
+/* Hand the buffer of 'ab' back to the state for the next refresh. */
+static void abKeep(struct abuf *ab, char **b, size_t *cap) {
+  *b = ab->b;
+  *cap = ab->cap;
+}
 
 /* Helper of refreshSingleLine() and refreshMultiLine() to show hints
- * to the right of the prompt. Now uses display widths for proper UTF-8. */
-void refreshShowHints(struct abuf *ab, struct linenoiseState *l, int pwidth) {
+ * to the right of the prompt. Now uses display widths for proper UTF-8.
+ * Returns the display width of the hint appended. */
+static size_t refreshShowHints(struct abuf *ab, struct linenoiseState *l,
+                               int pwidth) {
   char seq[64];
-  size_t bufwidth = utf8StrWidth(l->buf, l->len);
-  if (hintsCallback && pwidth + bufwidth < l->cols) {
+  size_t bufwidth = l->lencol;
+  size_t width = 0;
+  if (hintsCallback && !l->in_search && pwidth + bufwidth < l->cols) {
     int color = -1, bold = 0;
     char *hint = hintsCallback(l->buf, &color, &bold);
     if (hint) {
@@ -881,7 +1071,9 @@ void refreshShowHints(struct abuf *ab, struct linenoiseState *l, int pwidth) {
           i += clen;
         }
         hintlen = i;
+        hintwidth = w;
       }
+      width = hintwidth;
       if (bold == 1 && color == -1)
         color = 37;
       if (color != -1 || bold != 0)
@@ -897,6 +1089,80 @@ void refreshShowHints(struct abuf *ab, struct linenoiseState *l, int pwidth) {
         freeHintsCallback(hint);
     }
   }
+  return width;
+}
+
+/* Append the shortest sequence moving the cursor from column 'from' to
+ * column 'to' of the current row. 'from' may be 'cols' when the last write
+ * filled the row, in which case only an absolute move is reliable. */
+static void abMoveCursor(struct abuf *ab, size_t from, size_t to,
+                         size_t cols) {
+  char seq[64];
+
+  if (from == to)
+    return;
+  if (from >= cols || to == 0) {
+    if (to)
+      snprintf(seq, sizeof(seq), "\r\x1b[%dC", (int)to);
+    else
+      snprintf(seq, sizeof(seq), "\r");
+  } else if (to + 1 == from) {
+    snprintf(seq, sizeof(seq), "\b");
+  } else if (to < from) {
+    snprintf(seq, sizeof(seq), "\x1b[%dD", (int)(from - to));
+  } else {
+    snprintf(seq, sizeof(seq), "\x1b[%dC", (int)(to - from));
+  }
+  abAppend(ab, seq, strlen(seq));
+}
+
+/* Remember 'frame' (prompt, line and hint as just written) as what the
+ * screen shows now. */
+static void refreshSetFrame(struct linenoiseState *l, struct abuf *frame,
+                            size_t textlen, size_t width, size_t poscol) {
+  /* The old frame's buffer is where the next one will be rendered. */
+  l->spare = l->frame;
+  l->spare_cap = l->frame_cap;
+  abKeep(frame, &l->frame, &l->frame_cap);
+  l->frame_len = frame->len;
+  l->frame_textlen = textlen;
+  l->frame_width = width;
+  l->frame_poscol = poscol;
+  l->frame_valid = 1;
+}
+
+/* Write only the difference between the remembered frame and the new one
+ * to 'ab': move to the first column that changed, write the rest of the new
+ * frame, erase what is left of the old one, and put the cursor at
+ * 'poscol'. Appending at the end of the line this is just the new
+ * character, and moving the cursor is just the move. */
+static void refreshDiff(struct abuf *ab, struct linenoiseState *l,
+                        struct abuf *frame, size_t textlen, size_t width,
+                        size_t poscol) {
+  const char *old = l->frame;
+  const char *new = frame->b;
+  size_t n = textlen < l->frame_textlen ? textlen : l->frame_textlen;
+  size_t p = 0, col = l->frame_poscol;
+
+  while (p < n && new[p] == old[p])
+    p++;
+  /* Start at a character boundary. */
+  while (p > 0 && ((p < textlen && (new[p] & 0xC0) == 0x80) ||
+                   (p < l->frame_textlen && (old[p] & 0xC0) == 0x80)))
+    p--;
+
+  int same = p == textlen && textlen == l->frame_textlen &&
+             frame->len - textlen == l->frame_len - l->frame_textlen &&
+             memcmp(new + textlen, old + textlen, frame->len - textlen) == 0;
+  if (!same) {
+    size_t pcol = utf8StrWidth(new, p);
+    abMoveCursor(ab, col, pcol, l->cols);
+    abAppend(ab, new + p, frame->len - p);
+    if (width < l->frame_width)
+      abAppend(ab, "\x1b[0K", 4);
+    col = width;
+  }
+  abMoveCursor(ab, col, poscol, l->cols);
 }
 
 /* Single line low level line refresh.
@@ -911,19 +1177,15 @@ void refreshShowHints(struct abuf *ab, struct linenoiseState *l, int pwidth) {
  * for cursor positioning and horizontal scrolling. */
 static void refreshSingleLine(struct linenoiseState *l, int flags) {
   char seq[64];
-  size_t pwidth = utf8StrWidth(l->prompt, l->plen); /* Prompt display width */
+  size_t pwidth = l->pwidth; /* Prompt display width */
   int fd = l->ofd;
   char *buf = l->buf;
-  size_t len = l->len; /* Byte length of buffer to display */
-  size_t pos = l->pos; /* Byte position of cursor */
-  size_t poscol;       /* Display column of cursor */
-  size_t lencol;       /* Display width of buffer */
+  size_t len = l->len;       /* Byte length of buffer to display */
+  size_t pos = l->pos;       /* Byte position of cursor */
+  size_t poscol = l->poscol; /* Display column of cursor */
+  size_t lencol = l->lencol; /* Display width of buffer */
   struct abuf ab;
 
-  /* Calculate the display width up to cursor and total display width. */
-  poscol = utf8StrWidth(buf, pos);
-  lencol = utf8StrWidth(buf, len);
-
   /* Scroll the buffer horizontally if cursor is past the right edge.
    * We need to trim full UTF-8 characters from the left until the
    * cursor position fits within the terminal width. */
@@ -945,41 +1207,63 @@ static void refreshSingleLine(struct linenoiseState *l, int flags) {
     lencol -= cwidth;
   }
 
-  abInit(&ab);
-  /* Cursor to left edge */
-  snprintf(seq, sizeof(seq), "\r");
-  abAppend(&ab, seq, strlen(seq));
-
+  /* Render the prompt and the current buffer content, then the hints, as
+   * the new frame. */
+  struct abuf frame;
+  size_t textlen = 0, hintwidth = 0;
+  abReuse(&frame, l->spare, l->spare_cap);
   if (flags & REFRESH_WRITE) {
-    /* Write the prompt and the current buffer content */
-    abAppend(&ab, l->prompt, l->plen);
+    abAppend(&frame, l->prompt, l->plen);
     if (maskmode == 1) {
       /* In mask mode, we output one '*' per UTF-8 character, not byte */
       size_t i = 0;
       while (i < len) {
-        abAppend(&ab, "*", 1);
+        abAppend(&frame, "*", 1);
         i += utf8NextCharLen(buf, i, len);
       }
     } else {
-      abAppend(&ab, buf, len);
+      abAppend(&frame, buf, len);
     }
+    textlen = frame.len;
     /* Show hints if any. */
-    refreshShowHints(&ab, l, pwidth);
+    hintwidth = refreshShowHints(&frame, l, pwidth);
   }
 
-  /* Erase to right */
-  snprintf(seq, sizeof(seq), "\x1b[0K");
-  abAppend(&ab, seq, strlen(seq));
+  abReuse(&ab, l->out, l->out_cap);
+  if (flags == REFRESH_ALL && l->frame_valid && !full_refresh) {
+    /* The screen shows the last frame: only write what changed. */
+    refreshDiff(&ab, l, &frame, textlen, pwidth + lencol + hintwidth,
+                pwidth + poscol);
+  } else {
+    /* Cursor to left edge */
+    snprintf(seq, sizeof(seq), "\r");
+    abAppend(&ab, seq, strlen(seq));
 
-  if (flags & REFRESH_WRITE) {
-    /* Move cursor to original position (using display column, not byte). */
-    snprintf(seq, sizeof(seq), "\r\x1b[%dC", (int)(poscol + pwidth));
+    if (flags & REFRESH_WRITE)
+      abAppend(&ab, frame.b, frame.len);
+
+    /* Erase to right */
+    snprintf(seq, sizeof(seq), "\x1b[0K");
     abAppend(&ab, seq, strlen(seq));
+
+    if (flags & REFRESH_WRITE) {
+      /* Move cursor to original position (using display column, not byte). */
+      snprintf(seq, sizeof(seq), "\r\x1b[%dC", (int)(poscol + pwidth));
+      abAppend(&ab, seq, strlen(seq));
+    }
   }
 
-  if (write(fd, ab.b, ab.len) == -1) {
+  if (flags & REFRESH_WRITE) {
+    refreshSetFrame(l, &frame, textlen, pwidth + lencol + hintwidth,
+                    pwidth + poscol);
+  } else {
+    abKeep(&frame, &l->spare, &l->spare_cap);
+    l->frame_valid = 0;
+  }
+
+  if (ab.len > 0 && write(fd, ab.b, ab.len) == -1) {
   } /* Can't recover from write error. */
-  abFree(&ab);
+  abKeep(&ab, &l->out, &l->out_cap);
 }
 
 /* Multi line low level line refresh.
@@ -993,9 +1277,9 @@ static void refreshSingleLine(struct linenoiseState *l, int flags) {
  * This function is UTF-8 aware and uses display widths for positioning. */
 static void refreshMultiLine(struct linenoiseState *l, int flags) {
   char seq[64];
-  size_t pwidth = utf8StrWidth(l->prompt, l->plen); /* Prompt display width */
-  size_t bufwidth = utf8StrWidth(l->buf, l->len);   /* Buffer display width */
-  size_t poswidth = utf8StrWidth(l->buf, l->pos);   /* Cursor display width */
+  size_t pwidth = l->pwidth;   /* Prompt display width */
+  size_t bufwidth = l->lencol; /* Buffer display width */
+  size_t poswidth = l->poscol; /* Cursor display width */
   int rows = (pwidth + bufwidth + l->cols - 1) /
              l->cols;    /* rows used by current buf. */
   int rpos = l->oldrpos; /* cursor relative row from previous refresh. */
@@ -1009,7 +1293,7 @@ static void refreshMultiLine(struct linenoiseState *l, int flags) {
 
   /* First step: clear all the lines used before. To do so start by
    * going to the last row. */
-  abInit(&ab);
+  abReuse(&ab, l->out, l->out_cap);
 
   if (flags & REFRESH_CLEAN) {
     if (old_rows - rpos > 0) {
@@ -1091,7 +1375,7 @@ static void refreshMultiLine(struct linenoiseState *l, int flags) {
 
   if (write(fd, ab.b, ab.len) == -1) {
   } /* Can't recover from write error. */
-  abFree(&ab);
+  abKeep(&ab, &l->out, &l->out_cap);
 }
 
 /* Calls the two low level functions refreshSingleLine() or
@@ -1131,37 +1415,10 @@ void linenoiseShow(struct linenoiseState *l) {
  * On error writing to the terminal -1 is returned, otherwise 0. */
 int linenoiseEditInsert(struct linenoiseState *l, const char *c, size_t clen) {
   if (l->len + clen <= l->buflen) {
-    if (l->len == l->pos) {
-      /* Append at end of line. */
-      memcpy(l->buf + l->pos, c, clen);
-      l->pos += clen;
-      l->len += clen;
-      l->buf[l->len] = '\0';
-      if ((!mlmode &&
-           utf8StrWidth(l->prompt, l->plen) + utf8StrWidth(l->buf, l->len) <
-               l->cols &&
-           !hintsCallback)) {
-        /* Avoid a full update of the line in the trivial case:
-         * single-width char, no hints, fits in one line. */
-        if (maskmode == 1) {
-          if (write(l->ofd, "*", 1) == -1)
-            return -1;
-        } else {
-          if (write(l->ofd, c, clen) == -1)
-            return -1;
-        }
-      } else {
-        refreshLine(l);
-      }
-    } else {
-      /* Insert in the middle of the line. */
-      memmove(l->buf + l->pos + clen, l->buf + l->pos, l->len - l->pos);
-      memcpy(l->buf + l->pos, c, clen);
-      l->len += clen;
-      l->pos += clen;
-      l->buf[l->len] = '\0';
-      refreshLine(l);
-    }
+    editReplace(l, l->pos, 0, c, clen);
+    /* In single line mode, appending at the end of the line this writes
+     * just the new character as long as it fits (see refreshDiff()). */
+    refreshLine(l);
   }
   return 0;
 }
@@ -1169,23 +1426,36 @@ int linenoiseEditInsert(struct linenoiseState *l, const char *c, size_t clen) {
 /* Move cursor on the left. Moves by one UTF-8 character, not byte. */
 void linenoiseEditMoveLeft(struct linenoiseState *l) {
   if (l->pos > 0) {
-    l->pos -= utf8PrevCharLen(l->buf, l->pos);
+    editSetPos(l, l->pos - utf8PrevCharLen(l->buf, l->pos));
     refreshLine(l);
   }
 }
 
-/* Move cursor on the right. Moves by one UTF-8 character, not byte. */
+/* Move cursor on the right. Moves by one UTF-8 character, not byte. At the
+ * end of the line the hint shown there, if any, is taken as typed. */
 void linenoiseEditMoveRight(struct linenoiseState *l) {
   if (l->pos != l->len) {
-    l->pos += utf8NextCharLen(l->buf, l->pos, l->len);
+    editSetPos(l, l->pos + utf8NextCharLen(l->buf, l->pos, l->len));
     refreshLine(l);
+  } else if (hintsCallback) {
+    int color = -1, bold = 0;
+    char *hint = hintsCallback(l->buf, &color, &bold);
+    if (hint) {
+      size_t hintlen = strlen(hint);
+      if (hintlen > 0 && l->len + hintlen <= l->buflen) {
+        editReplace(l, l->pos, 0, hint, hintlen);
+        refreshLine(l);
+      }
+      if (freeHintsCallback)
+        freeHintsCallback(hint);
+    }
   }
 }
 
 /* Move cursor to the start of the line. */
 void linenoiseEditMoveHome(struct linenoiseState *l) {
   if (l->pos != 0) {
-    l->pos = 0;
+    editSetPos(l, 0);
     refreshLine(l);
   }
 }
@@ -1193,7 +1463,7 @@ void linenoiseEditMoveHome(struct linenoiseState *l) {
 /* Move cursor to the end of the line. */
 void linenoiseEditMoveEnd(struct linenoiseState *l) {
   if (l->pos != l->len) {
-    l->pos = l->len;
+    editSetPos(l, l->len);
     refreshLine(l);
   }
 }
@@ -1206,8 +1476,11 @@ void linenoiseEditHistoryNext(struct linenoiseState *l, int dir) {
   if (history_len > 1) {
     /* Update the current history entry before to
      * overwrite it with the next one. */
-    free(history[history_len - 1 - l->history_index]);
-    history[history_len - 1 - l->history_index] = strdup(l->buf);
+    char **slot = historySlot(history_len - 1 - l->history_index);
+    historyFree(*slot);
+    *slot = strdup(l->buf);
+    if (*slot != NULL)
+      historyIndex(*slot, history_seq + history_len - 1 - l->history_index);
     /* Show the new entry */
     l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
     if (l->history_index < 0) {
@@ -1217,22 +1490,128 @@ void linenoiseEditHistoryNext(struct linenoiseState *l, int dir) {
       l->history_index = history_len - 1;
       return;
     }
-    strncpy(l->buf, history[history_len - 1 - l->history_index], l->buflen);
+    strncpy(l->buf, *historySlot(history_len - 1 - l->history_index),
+            l->buflen);
     l->buf[l->buflen - 1] = '\0';
     l->len = l->pos = strlen(l->buf);
+    editSync(l);
     refreshLine(l);
   }
 }
 
+/* ============================ Reverse search ==============================
+ *
+ * Ctrl-R switches to reverse-i-search: typed characters go to the query and
+ * the newest history entry containing it is shown in the buffer, with the
+ * prompt replaced by the query. Ctrl-R again steps to older matches,
+ * Ctrl-G (or Ctrl-C) cancels, and any other key accepts the match and is
+ * then handled as usual, so Enter runs it right away. */
+
+static char search_prompt[128];
+
+static void searchRefresh(struct linenoiseState *l, int failed) {
+  snprintf(search_prompt, sizeof(search_prompt), "(%sreverse-i-search)`%s': ",
+           failed ? "failed " : "", l->search);
+  editSetPrompt(l, search_prompt, strlen(search_prompt));
+  refreshLine(l);
+}
+
+static void searchShow(struct linenoiseState *l, const char *line) {
+  size_t len = strlen(line);
+  if (len > l->buflen)
+    len = l->buflen;
+  memcpy(l->buf, line, len);
+  l->buf[len] = '\0';
+  l->len = l->pos = len;
+  editSync(l);
+}
+
+/* Show the newest entry older than 'before' matching the query. */
+static void searchUpdate(struct linenoiseState *l, long before) {
+  if (l->search_len == 0) {
+    searchShow(l, l->search_orig);
+    l->search_seq = history_seq + history_len - 1;
+    searchRefresh(l, 0);
+    return;
+  }
+
+  long seq = historySearch(l->search, before);
+  if (seq != -1) {
+    searchShow(l, historyEntry(seq));
+    const char *match = strstr(l->buf, l->search);
+    if (match != NULL)
+      editSetPos(l, match - l->buf);
+    l->search_seq = seq;
+  }
+  searchRefresh(l, seq == -1);
+}
+
+static void searchStart(struct linenoiseState *l) {
+  l->search_orig = strdup(l->buf);
+  if (l->search_orig == NULL)
+    return;
+  l->in_search = 1;
+  l->search[0] = '\0';
+  l->search_len = 0;
+  /* The newest entry is the line being edited, it's not searched. */
+  l->search_seq = history_seq + history_len - 1;
+  l->orig_prompt = l->prompt;
+  l->orig_plen = l->plen;
+  searchRefresh(l, 0);
+}
+
+/* Leave search mode, with the match in the buffer if 'accept' is set and
+ * the line from before the search otherwise. */
+static void searchStop(struct linenoiseState *l, int accept) {
+  if (!accept)
+    searchShow(l, l->search_orig);
+  free(l->search_orig);
+  l->search_orig = NULL;
+  l->in_search = 0;
+  editSetPrompt(l, l->orig_prompt, l->orig_plen);
+  refreshLine(l);
+}
+
+/* Handle a key while in search mode. Returns 0 if it was used by the
+ * search, or the key to handle as usual after the search was accepted. */
+static int searchFeed(struct linenoiseState *l, char c) {
+  long newest = history_seq + history_len - 1;
+
+  switch (c) {
+  case CTRL_R:
+    searchUpdate(l, l->search_len ? l->search_seq : newest);
+    return 0;
+  case BACKSPACE:
+  case CTRL_H:
+    if (l->search_len > 0)
+      l->search[--l->search_len] = '\0';
+    searchUpdate(l, newest);
+    return 0;
+  case CTRL_G:
+  case CTRL_C:
+    searchStop(l, 0);
+    return 0;
+  default:
+    if ((unsigned char)c < 32) {
+      searchStop(l, 1);
+      return c;
+    }
+    if (l->search_len < sizeof(l->search) - 1) {
+      l->search[l->search_len++] = c;
+      l->search[l->search_len] = '\0';
+    }
+    /* The current match may still match the longer query. */
+    searchUpdate(l, l->search_seq + 1 < newest ? l->search_seq + 1 : newest);
+    return 0;
+  }
+}
+
 /* Delete the character at the right of the cursor without altering the cursor
  * position. Basically this is what happens with the "Delete" keyboard key.
  * Now handles multi-byte UTF-8 characters. */
 void linenoiseEditDelete(struct linenoiseState *l) {
   if (l->len > 0 && l->pos < l->len) {
-    size_t clen = utf8NextCharLen(l->buf, l->pos, l->len);
-    memmove(l->buf + l->pos, l->buf + l->pos + clen, l->len - l->pos - clen);
-    l->len -= clen;
-    l->buf[l->len] = '\0';
+    editReplace(l, l->pos, utf8NextCharLen(l->buf, l->pos, l->len), NULL, 0);
     refreshLine(l);
   }
 }
@@ -1241,10 +1620,7 @@ void linenoiseEditDelete(struct linenoiseState *l) {
 void linenoiseEditBackspace(struct linenoiseState *l) {
   if (l->pos > 0 && l->len > 0) {
     size_t clen = utf8PrevCharLen(l->buf, l->pos);
-    memmove(l->buf + l->pos - clen, l->buf + l->pos, l->len - l->pos);
-    l->pos -= clen;
-    l->len -= clen;
-    l->buf[l->len] = '\0';
+    editReplace(l, l->pos - clen, clen, NULL, 0);
     refreshLine(l);
   }
 }
@@ -1252,19 +1628,108 @@ void linenoiseEditBackspace(struct linenoiseState *l) {
 /* Delete the previous word, maintaining the cursor at the start of the
  * current word. Handles UTF-8 by moving character-by-character. */
 void linenoiseEditDeletePrevWord(struct linenoiseState *l) {
-  size_t old_pos = l->pos;
-  size_t diff;
+  size_t pos = l->pos;
 
   /* Skip spaces before the word (move backwards by UTF-8 chars). */
-  while (l->pos > 0 && l->buf[l->pos - 1] == ' ')
-    l->pos -= utf8PrevCharLen(l->buf, l->pos);
+  while (pos > 0 && l->buf[pos - 1] == ' ')
+    pos -= utf8PrevCharLen(l->buf, pos);
   /* Skip non-space characters (move backwards by UTF-8 chars). */
-  while (l->pos > 0 && l->buf[l->pos - 1] != ' ')
-    l->pos -= utf8PrevCharLen(l->buf, l->pos);
-  diff = old_pos - l->pos;
-  memmove(l->buf + l->pos, l->buf + old_pos, l->len - old_pos + 1);
-  l->len -= diff;
+  while (pos > 0 && l->buf[pos - 1] != ' ')
+    pos -= utf8PrevCharLen(l->buf, pos);
+  editReplace(l, pos, l->pos - pos, NULL, 0);
+  refreshLine(l);
+}
+
+/* Input that was read but not used yet: what followed the end of a
+ * bracketed paste in the last chunk read for it. editRead() returns it
+ * before reading the terminal again. */
+#define PASTE_CHUNK 4096
+static char pending_input[PASTE_CHUNK];
+static size_t pending_pos = 0, pending_len = 0;
+
+/* read() from 'fd', but pending input first. */
+static ssize_t editRead(int fd, void *buf, size_t count) {
+  if (pending_pos == pending_len)
+    return read(fd, buf, count);
+  if (count > pending_len - pending_pos)
+    count = pending_len - pending_pos;
+  memcpy(buf, pending_input + pending_pos, count);
+  pending_pos += count;
+  return count;
+}
+
+/* Give back the last 'len' bytes editRead() returned, which are at 'p'. */
+static void editUnread(const char *p, size_t len) {
+  if (pending_pos < pending_len) {
+    /* They came from pending_input and are still there. */
+    pending_pos -= len;
+    return;
+  }
+  memcpy(pending_input, p, len);
+  pending_pos = 0;
+  pending_len = len;
+}
+
+/* Insert text pasted by the user. With bracketed paste enabled the
+ * terminal sends it between ESC [ 200 ~ and ESC [ 201 ~: this is called
+ * after the start marker, reads up to the end marker and inserts the text
+ * with a single refresh, instead of one refresh per character. The text is
+ * read PASTE_CHUNK bytes at a time, and whatever was read past the end
+ * marker is kept for editRead() as typed input. (A caller of the
+ * multiplexed API that waits for the input to be readable before calling
+ * linenoiseEditFeed() only sees it with the next key.)
+ *
+ * The line can't hold line breaks, so only the first line of the text is
+ * inserted (a trailing line break is just dropped), other control
+ * characters become spaces, and what doesn't fit the buffer is cut. Both
+ * cuts beep. */
+#define PASTE_END "\x1b[201~"
+#define PASTE_END_LEN 6
+static void linenoiseEditPaste(struct linenoiseState *l) {
+  struct abuf ab;
+  size_t matched = 0; /* Bytes of PASTE_END at the end of ab. */
+  char chunk[PASTE_CHUNK];
+
+  abReuse(&ab, NULL, 0);
+  while (matched < PASTE_END_LEN) {
+    ssize_t nread = editRead(l->ifd, chunk, sizeof(chunk));
+    if (nread <= 0)
+      break;
+    ssize_t i;
+    for (i = 0; i < nread && matched < PASTE_END_LEN; i++) {
+      if (chunk[i] == PASTE_END[matched])
+        matched++;
+      else
+        matched = chunk[i] == ESC;
+    }
+    abAppend(&ab, chunk, i);
+    if (i < nread)
+      editUnread(chunk + i, nread - i);
+  }
+
+  char *text = ab.b;
+  size_t len = ab.len - matched, n = 0, rest;
+  int cut = 0;
+  for (; n < len && text[n] != '\n' && text[n] != '\r'; n++) {
+    if ((unsigned char)text[n] < 32 || text[n] == 127)
+      text[n] = ' ';
+  }
+  for (rest = n; rest < len && (text[rest] == '\n' || text[rest] == '\r');)
+    rest++;
+  if (rest < len)
+    cut = 1;
+  if (n > l->buflen - l->len) {
+    n = l->buflen - l->len;
+    while (n > 0 && (text[n] & 0xC0) == 0x80)
+      n--;
+    cut = 1;
+  }
+
+  editReplace(l, l->pos, 0, text, n);
   refreshLine(l);
+  if (cut)
+    linenoiseBeep();
+  free(ab.b);
 }
 
 /* This function is part of the multiplexed API of Linenoise, that is used
@@ -1296,17 +1761,23 @@ int linenoiseEditStart(struct linenoiseState *l, int stdin_fd, int stdout_fd,
   /* Populate the linenoise state that we pass to functions implementing
    * specific editing functionalities. */
   l->in_completion = 0;
+  l->in_search = 0;
+  l->search_orig = NULL;
+  l->frame = l->spare = l->out = NULL;
+  l->frame_cap = l->spare_cap = l->out_cap = 0;
+  l->frame_valid = 0;
   l->ifd = stdin_fd != -1 ? stdin_fd : STDIN_FILENO;
+  full_refresh = getenv("LINENOISE_FULL_REFRESH") != NULL;
   l->ofd = stdout_fd != -1 ? stdout_fd : STDOUT_FILENO;
   l->buf = buf;
   l->buflen = buflen;
-  l->prompt = prompt;
-  l->plen = strlen(prompt);
+  editSetPrompt(l, prompt, strlen(prompt));
   l->oldpos = l->pos = 0;
   l->len = 0;
+  l->poscol = l->lencol = 0;
 
   /* Enter raw mode. */
-  if (enableRawMode(l->ifd) == -1)
+  if (enableRawMode(l->ifd, l->ofd) == -1)
     return -1;
 
   l->cols = getColumns(stdin_fd, stdout_fd);
@@ -1326,10 +1797,19 @@ int linenoiseEditStart(struct linenoiseState *l, int stdin_fd, int stdout_fd,
 
   /* The latest history entry is always our current buffer, that
    * initially is just an empty string. */
-  linenoiseHistoryAdd("");
+  historyAdd("");
 
   if (write(l->ofd, prompt, l->plen) == -1)
     return -1;
+  /* The prompt is the first frame. */
+  l->frame = malloc(l->plen);
+  if (l->frame != NULL) {
+    memcpy(l->frame, prompt, l->plen);
+    l->frame_cap = l->plen;
+    l->frame_len = l->frame_textlen = l->plen;
+    l->frame_width = l->frame_poscol = l->pwidth;
+    l->frame_valid = 1;
+  }
   return 0;
 }
 
@@ -1366,13 +1846,21 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
   int nread;
   char seq[3];
 
-  nread = read(l->ifd, &c, 1);
+  nread = editRead(l->ifd, &c, 1);
   if (nread < 0) {
     return (errno == EAGAIN || errno == EWOULDBLOCK) ? linenoiseEditMore : NULL;
   } else if (nread == 0) {
     return NULL;
   }
 
+  /* In reverse search mode keys edit the query; a key that ends the search
+   * is then handled below. */
+  if (l->in_search) {
+    c = searchFeed(l, c);
+    if (c == 0)
+      return linenoiseEditMore;
+  }
+
   /* Only autocomplete when the callback is set. It returns < 0 when
    * there was an error reading from fd. Otherwise it will return the
    * character that should be handled next. */
@@ -1389,7 +1877,7 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
   switch (c) {
   case ENTER: /* enter */
     history_len--;
-    free(history[history_len]);
+    historyFree(*historySlot(history_len));
     if (mlmode)
       linenoiseEditMoveEnd(l);
     if (hintsCallback) {
@@ -1414,7 +1902,7 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
       linenoiseEditDelete(l);
     } else {
       history_len--;
-      free(history[history_len]);
+      historyFree(*historySlot(history_len));
       errno = ENOENT;
       return NULL;
     }
@@ -1432,6 +1920,7 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
       memcpy(l->buf + prevstart, tmp, currlen);
       if (l->pos + currlen <= l->len)
         l->pos += currlen;
+      editSync(l);
       refreshLine(l);
     }
     break;
@@ -1447,20 +1936,23 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
   case CTRL_N: /* ctrl-n */
     linenoiseEditHistoryNext(l, LINENOISE_HISTORY_NEXT);
     break;
+  case CTRL_R: /* ctrl-r, reverse incremental history search */
+    searchStart(l);
+    break;
   case ESC: /* escape sequence */
     /* Read the next two bytes representing the escape sequence.
      * Use two calls to handle slow terminals returning the two
      * chars at different times. */
-    if (read(l->ifd, seq, 1) == -1)
+    if (editRead(l->ifd, seq, 1) == -1)
       break;
-    if (read(l->ifd, seq + 1, 1) == -1)
+    if (editRead(l->ifd, seq + 1, 1) == -1)
       break;
 
     /* ESC [ sequences. */
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
         /* Extended escape, read additional byte. */
-        if (read(l->ifd, seq + 2, 1) == -1)
+        if (editRead(l->ifd, seq + 2, 1) == -1)
           break;
         if (seq[2] == '~') {
           switch (seq[1]) {
@@ -1468,6 +1960,11 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
             linenoiseEditDelete(l);
             break;
           }
+        } else if (seq[1] == '2' && seq[2] == '0') {
+          /* Start of a bracketed paste, ESC [ 2 0 0 ~. */
+          if (editRead(l->ifd, seq, 2) == 2 && seq[0] == '0' &&
+              seq[1] == '~')
+            linenoiseEditPaste(l);
         }
       } else {
         switch (seq[1]) {
@@ -1517,7 +2014,7 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
         /* Read remaining bytes of the UTF-8 sequence. */
         int i;
         for (i = 1; i < utf8len; i++) {
-          if (read(l->ifd, utf8 + i, 1) != 1)
+          if (editRead(l->ifd, utf8 + i, 1) != 1)
             break;
         }
       }
@@ -1528,11 +2025,13 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
   case CTRL_U: /* Ctrl+u, delete the whole line. */
     l->buf[0] = '\0';
     l->pos = l->len = 0;
+    l->poscol = l->lencol = 0;
     refreshLine(l);
     break;
   case CTRL_K: /* Ctrl+k, delete from current to end of line. */
     l->buf[l->pos] = '\0';
     l->len = l->pos;
+    l->lencol = l->poscol;
     refreshLine(l);
     break;
   case CTRL_A: /* Ctrl+a, go to the start of the line */
@@ -1543,6 +2042,7 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
     break;
   case CTRL_L: /* ctrl+l, clear screen */
     linenoiseClearScreen();
+    l->frame_valid = 0;
     refreshLine(l);
     break;
   case CTRL_W: /* ctrl+w, delete previous word */
@@ -1557,6 +2057,11 @@ char *linenoiseEditFeed(struct linenoiseState *l) {
  * returns something different than NULL. At this point the user input
  * is in the buffer, and we can restore the terminal in normal mode. */
 void linenoiseEditStop(struct linenoiseState *l) {
+  free(l->frame);
+  free(l->spare);
+  free(l->out);
+  l->frame = l->spare = l->out = NULL;
+  l->frame_valid = 0;
   if (!isatty(l->ifd) && !getenv("LINENOISE_ASSUME_TTY"))
     return;
   disableRawMode(l->ifd);
@@ -1593,7 +2098,7 @@ void linenoisePrintKeyCodes(void) {
 
   printf("Linenoise key codes debugging mode.\n"
          "Press keys to see scan codes. Type 'quit' at any time to exit.\n");
-  if (enableRawMode(STDIN_FILENO) == -1)
+  if (enableRawMode(STDIN_FILENO, STDOUT_FILENO) == -1)
     return;
   memset(quit, ' ', 4);
   while (1) {
@@ -1705,9 +2210,11 @@ static void freeHistory(void) {
     int j;
 
     for (j = 0; j < history_len; j++)
-      free(history[j]);
+      historyFree(*historySlot(j));
     free(history);
   }
+  freeTrigrams();
+  freePrefixIndex();
 }
 
 /* At exit we'll try to fix the terminal to the initial conditions. */
@@ -1716,46 +2223,567 @@ static void linenoiseAtExit(void) {
   freeHistory();
 }
 
-/* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
+/* The history is a circular buffer of history_max_len slots: entry 'i'
+ * (0 is the oldest) lives 'i' slots after history_start, wrapping around.
+ * Return the slot of entry 'i'. */
+static char **historySlot(int i) {
+  i += history_start;
+  if (i >= history_max_len)
+    i -= history_max_len;
+  return &history[i];
+}
+
+/* Free a history entry, which is either its own allocation or part of
+ * history_block. */
+static void historyFree(char *line) {
+  if (history_block != NULL && line >= history_block &&
+      line < history_block + history_block_size) {
+    if (--history_block_refs == 0) {
+      free(history_block);
+      history_block = NULL;
+    }
+    return;
+  }
+  free(line);
+}
+
+/* ======================== History search index ============================
  *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
-int linenoiseHistoryAdd(const char *line) {
-  char *linecopy;
+ * Ctrl-R looks lines up through a trigram index: for every three byte
+ * sequence, the list of history entries that contain it, oldest first. An
+ * entry is named by its sequence number, which keeps growing as lines are
+ * added (history_seq is the oldest entry's), so evicting an entry doesn't
+ * touch the index; the lists just drop numbers below history_seq as they
+ * are used. Lists that are never used again, and the trigrams of evicted
+ * lines, would pile up though, so like the prefix index below the whole
+ * index is rebuilt from the history once it indexed
+ * LINENOISE_HISTORY_COMPACT_FACTOR times as many lines as the history
+ * holds. A search only checks the entries in the list of the query's
+ * rarest trigram, newest first, instead of every line of the history. */
+
+#define TRIGRAM_BUCKETS (1 << 14)
+
+struct trigram {
+  uint32_t key;        /* The three bytes. */
+  long *seqs;          /* Entries containing them, ascending. */
+  size_t start;        /* First entry in seqs that may still be live. */
+  size_t len;          /* Used entries in seqs. */
+  size_t cap;          /* Allocated entries in seqs. */
+  struct trigram *next;
+};
 
-  if (history_max_len == 0)
+static struct trigram **trigram_table = NULL;
+static long trigram_lines = 0; /* Lines indexed since the last rebuild. */
+
+static uint32_t trigramKey(const char *p) {
+  return (uint32_t)(unsigned char)p[0] << 16 |
+         (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+}
+
+/* Find the list for 'key', creating it if 'create' is set. */
+static struct trigram *trigramGet(uint32_t key, int create) {
+  struct trigram **bucket =
+      &trigram_table[(key * 2654435761u) >> (32 - 14)];
+  struct trigram *t;
+
+  for (t = *bucket; t != NULL; t = t->next)
+    if (t->key == key)
+      return t;
+  if (!create || (t = calloc(1, sizeof(*t))) == NULL)
+    return NULL;
+  t->key = key;
+  t->next = *bucket;
+  *bucket = t;
+  return t;
+}
+
+/* Drop the evicted entries from the front of a list, moving the live ones
+ * down once they are less than half of it. */
+static void trigramTrim(struct trigram *t) {
+  while (t->start < t->len && t->seqs[t->start] < history_seq)
+    t->start++;
+  if (t->start > 0 && t->start >= t->len / 2) {
+    memmove(t->seqs, t->seqs + t->start,
+            sizeof(long) * (t->len - t->start));
+    t->len -= t->start;
+    t->start = 0;
+  }
+}
+
+/* Add entry 'seq' to the list of every trigram of 'line'. */
+static void trigramInsert(const char *line, long seq) {
+  size_t len = strlen(line);
+  size_t j;
+
+  for (j = 0; j + 2 < len; j++) {
+    struct trigram *t = trigramGet(trigramKey(line + j), 1);
+    if (t == NULL)
+      continue;
+    trigramTrim(t);
+    size_t lo = t->len;
+    if (t->len > t->start && t->seqs[t->len - 1] >= seq) {
+      size_t hi = t->len;
+      for (lo = t->start; lo < hi;) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->seqs[mid] < seq)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      /* A trigram that repeats within the line is listed once. */
+      if (t->seqs[lo] == seq)
+        continue;
+    }
+    if (t->len == t->cap) {
+      size_t cap = t->cap ? t->cap * 2 : 4;
+      long *seqs = realloc(t->seqs, sizeof(long) * cap);
+      if (seqs == NULL)
+        continue;
+      t->seqs = seqs;
+      t->cap = cap;
+    }
+    memmove(t->seqs + lo + 1, t->seqs + lo, sizeof(long) * (t->len - lo));
+    t->seqs[lo] = seq;
+    t->len++;
+  }
+}
+
+/* Index entry 'seq'. It is usually the newest entry and goes at the end of
+ * the lists, but an entry edited while browsing the history is indexed
+ * again in its place. Its old trigrams stay listed until the next rebuild;
+ * the search checks every entry it finds anyway. */
+static void historyIndex(const char *line, long seq) {
+  int j;
+
+  if (trigram_table == NULL ||
+      trigram_lines >= (long)history_max_len * LINENOISE_HISTORY_COMPACT_FACTOR) {
+    /* Start over from the live entries. */
+    freeTrigrams();
+    trigram_table = calloc(TRIGRAM_BUCKETS, sizeof(struct trigram *));
+    if (trigram_table == NULL)
+      return;
+    for (j = 0; j < history_len; j++)
+      trigramInsert(*historySlot(j), history_seq + j);
+  }
+  trigramInsert(line, seq);
+  trigram_lines++;
+}
+
+static void freeTrigrams(void) {
+  int j;
+
+  if (trigram_table == NULL)
+    return;
+  for (j = 0; j < TRIGRAM_BUCKETS; j++) {
+    struct trigram *t = trigram_table[j];
+    while (t != NULL) {
+      struct trigram *next = t->next;
+      free(t->seqs);
+      free(t);
+      t = next;
+    }
+  }
+  free(trigram_table);
+  trigram_table = NULL;
+  trigram_lines = 0;
+}
+
+/* ========================= History prefix index ===========================
+ *
+ * Hints show the newest entry that starts with the edited line, and they
+ * are looked up on every refresh. So the entries are also kept in a trie of
+ * their bytes where each node holds the newest entry below it: a lookup
+ * walks the line and checks a single entry, however large the history is.
+ * Like the trigram lists the trie isn't touched when an entry is evicted,
+ * since the node of an evicted entry can only hold evicted ones too. It is
+ * rebuilt from the history instead, once it indexed
+ * LINENOISE_HISTORY_COMPACT_FACTOR times as many lines as the history
+ * holds. Nodes live in one array and link to each other by index, so the
+ * rebuild starts over without freeing anything. */
+
+struct prefixNode {
+  uint32_t child; /* First child, 0 if none (the root is never a child). */
+  uint32_t next;  /* Next sibling, 0 if none. */
+  long newest;    /* Newest entry starting with the bytes up to here. */
+  char c;
+};
+
+static struct prefixNode *prefix_nodes = NULL; /* [0] is the root. */
+static uint32_t prefix_used = 0;
+static uint32_t prefix_cap = 0;
+static long prefix_lines = 0; /* Lines indexed since the last rebuild. */
+
+/* Make room for one more node. Returns -1 if out of memory. */
+static int prefixGrow(void) {
+  if (prefix_used == prefix_cap) {
+    uint32_t cap = prefix_cap ? prefix_cap * 2 : 256;
+    struct prefixNode *nodes = realloc(prefix_nodes, sizeof(*nodes) * cap);
+    if (nodes == NULL)
+      return -1;
+    prefix_nodes = nodes;
+    prefix_cap = cap;
+  }
+  return 0;
+}
+
+/* Return a new node, or 0 if out of memory. */
+static uint32_t prefixNew(char c) {
+  if (prefixGrow() == -1)
     return 0;
+  prefix_nodes[prefix_used].child = prefix_nodes[prefix_used].next = 0;
+  prefix_nodes[prefix_used].newest = -1;
+  prefix_nodes[prefix_used].c = c;
+  return prefix_used++;
+}
+
+static uint32_t prefixChild(uint32_t node, char c) {
+  uint32_t n;
+
+  for (n = prefix_nodes[node].child; n != 0; n = prefix_nodes[n].next)
+    if (prefix_nodes[n].c == c)
+      return n;
+  return 0;
+}
+
+static void prefixInsert(const char *line, long seq) {
+  uint32_t node = 0;
+
+  prefix_nodes[0].newest = seq;
+  for (; *line; line++) {
+    uint32_t n = prefixChild(node, *line);
+    if (n == 0) {
+      if ((n = prefixNew(*line)) == 0)
+        return;
+      prefix_nodes[n].next = prefix_nodes[node].child;
+      prefix_nodes[node].child = n;
+    }
+    prefix_nodes[n].newest = seq;
+    node = n;
+  }
+}
+
+/* Add entry 'seq', the newest, to the trie. */
+static void prefixIndex(const char *line, long seq) {
+  int j;
+
+  if (prefix_nodes == NULL ||
+      prefix_lines >= (long)history_max_len * LINENOISE_HISTORY_COMPACT_FACTOR) {
+    /* Start over with just the root. */
+    prefix_used = 0;
+    prefix_lines = 0;
+    if (prefixGrow() == -1)
+      return;
+    prefixNew('\0');
+    for (j = 0; j < history_len; j++)
+      prefixInsert(*historySlot(j), history_seq + j);
+  }
+  prefixInsert(line, seq);
+  prefix_lines++;
+}
+
+static void freePrefixIndex(void) {
+  free(prefix_nodes);
+  prefix_nodes = NULL;
+  prefix_used = prefix_cap = 0;
+}
+
+static const char *historyEntry(long seq) {
+  return *historySlot(seq - history_seq);
+}
+
+/* Return the newest entry older than 'before' that contains 'query', or -1
+ * if there is none. Queries shorter than a trigram are matched against
+ * every entry. */
+static long historySearch(const char *query, long before) {
+  size_t qlen = strlen(query);
+  long newest = history_seq + history_len;
+  long seq;
+  size_t j;
+
+  if (before > newest)
+    before = newest;
+  if (qlen < 3 || trigram_table == NULL) {
+    for (seq = before - 1; seq >= history_seq; seq--)
+      if (strstr(historyEntry(seq), query) != NULL)
+        return seq;
+    return -1;
+  }
+
+  /* Every match is in the list of each of the query's trigrams, so the
+   * shortest one is all that needs checking. */
+  struct trigram *best = NULL;
+  for (j = 0; j + 2 < qlen; j++) {
+    struct trigram *t = trigramGet(trigramKey(query + j), 0);
+    if (t == NULL)
+      return -1;
+    trigramTrim(t);
+    if (best == NULL || t->len - t->start < best->len - best->start)
+      best = t;
+  }
+
+  /* Binary search for the first listed entry not older than 'before'. */
+  size_t lo = best->start, hi = best->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (best->seqs[mid] < before)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  while (lo-- > best->start) {
+    seq = best->seqs[lo];
+    if (seq < history_seq)
+      break;
+    if (strstr(historyEntry(seq), query) != NULL)
+      return seq;
+  }
+  return -1;
+}
 
-  /* Initialization on first call. */
+/* Allocate the history on first use. Returns 0 if there can't be any. */
+static int historyInit(void) {
+  if (history_max_len == 0)
+    return 0;
   if (history == NULL) {
     history = malloc(sizeof(char *) * history_max_len);
     if (history == NULL)
       return 0;
     memset(history, 0, (sizeof(char *) * history_max_len));
   }
+  return 1;
+}
 
-  /* Don't add duplicated lines. */
-  if (history_len && !strcmp(history[history_len - 1], line))
-    return 0;
+/* Whether 'line' repeats the latest entry, in which case it isn't added. */
+static int historyIsDup(const char *line) {
+  return history_len && !strcmp(*historySlot(history_len - 1), line);
+}
 
-  /* Add an heap allocated copy of the line in the history.
-   * If we reached the max length, remove the older line. */
-  linecopy = strdup(line);
-  if (!linecopy)
-    return 0;
+/* Store 'line' (already allocated) as the newest entry. When the history
+ * max length is reached the oldest entry is freed and history_start moves
+ * past it, so both adding and evicting are O(1) however large the history
+ * is. */
+static void historyPush(char *line) {
   if (history_len == history_max_len) {
-    free(history[0]);
-    memmove(history, history + 1, sizeof(char *) * (history_max_len - 1));
+    historyFree(history[history_start]);
+    history[history_start] = NULL;
+    history_start = (history_start + 1) % history_max_len;
+    history_seq++;
     history_len--;
   }
-  history[history_len] = linecopy;
+  *historySlot(history_len) = line;
+  historyIndex(line, history_seq + history_len);
+  prefixIndex(line, history_seq + history_len);
   history_len++;
+}
+
+/* Add a heap allocated copy of 'line' to the in-memory history. */
+static int historyAdd(const char *line) {
+  char *linecopy;
+
+  if (!historyInit() || historyIsDup(line))
+    return 0;
+  linecopy = strdup(line);
+  if (!linecopy)
+    return 0;
+  historyPush(linecopy);
+  return 1;
+}
+
+/* Return the offset in 'data' where its last 'maxlines' lines start (0 if
+ * it has fewer), scanning backward from the end so the lines before them
+ * are never looked at. The number of lines found is stored in *lines. */
+static size_t historyTail(const char *data, size_t size, long maxlines,
+                          long *lines) {
+  size_t start = size;
+
+  *lines = 0;
+  if (maxlines <= 0 || size == 0)
+    return size;
+  /* The final newline ends the last line, it doesn't start a new one. */
+  if (data[start - 1] == '\n')
+    start--;
+  while (start > 0) {
+    if (data[start - 1] == '\n' && ++*lines == maxlines)
+      return start;
+    start--;
+  }
+  (*lines)++;
+  return 0;
+}
+
+/* Map 'filename' read-only. Returns NULL (with *size 0) for an empty file or
+ * on error; errors also set *err. */
+static char *historyMap(const char *filename, size_t *size, int *err) {
+  struct stat st;
+  char *data;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+  *size = 0;
+  *err = 0;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    *err = 1;
+    if (fd != -1)
+      close(fd);
+    return NULL;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    *err = 1;
+    return NULL;
+  }
+  *size = st.st_size;
+  return data;
+}
+
+/* Rewrite the history file with just its last history_max_len lines. The
+ * file itself is the source, not our in-memory history, so lines other
+ * shells appended are kept. The new file is written next to the old one and
+ * renamed over it, so a reader never sees a half written history. Called
+ * with the file locked (see historyLock()), so it is read, rewritten and
+ * replaced without another shell appending or compacting in between. */
+static void historyCompact(void) {
+  size_t namelen = strlen(history_file);
+  char *tmp = malloc(namelen + 8);
+  char *data = NULL;
+  size_t size;
+  long lines;
+  int err, out = -1;
+
+  if (tmp == NULL)
+    return;
+  memcpy(tmp, history_file, namelen);
+  memcpy(tmp + namelen, ".XXXXXX", 8);
+
+  data = historyMap(history_file, &size, &err);
+  if (data == NULL)
+    goto done;
+  size_t start = historyTail(data, size, history_max_len, &lines);
+
+  out = mkstemp(tmp);
+  if (out == -1)
+    goto done;
+  for (size_t off = start; off < size;) {
+    ssize_t n = write(out, data + off, size - off);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      unlink(tmp);
+      goto done;
+    }
+    off += n;
+  }
+  if (rename(tmp, history_file) == 0)
+    history_file_lines = lines;
+  else
+    unlink(tmp);
+
+done:
+  if (out != -1)
+    close(out);
+  if (data != NULL)
+    munmap(data, size);
+  free(tmp);
+}
+
+/* Take an exclusive flock() on history_fd, reopening it first if another
+ * shell compacted (replaced) the file in the meantime: a lock on the old
+ * file would no longer keep anyone out of the new one. Appends and
+ * compactions of every shell happen under this lock. On success 0 is
+ * returned with the lock held, otherwise -1. */
+static int historyLock(void) {
+  struct stat named, opened;
+
+  for (;;) {
+    while (flock(history_fd, LOCK_EX) == -1)
+      if (errno != EINTR)
+        return -1;
+    if (stat(history_file, &named) == 0 && fstat(history_fd, &opened) == 0 &&
+        named.st_dev == opened.st_dev && named.st_ino == opened.st_ino)
+      return 0;
+    /* Closing it drops the lock on the old file. */
+    close(history_fd);
+    history_fd = open(history_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR);
+    /* A compacted file holds about history_max_len lines. */
+    history_file_lines = history_max_len;
+    if (history_fd == -1)
+      return -1;
+  }
+}
+
+/* This is the API call to add a new entry in the linenoise history. In
+ * append mode (see linenoiseHistorySetAppendFile()) a new entry is also
+ * written to the history file right away, with a single O_APPEND write under
+ * the file's lock, so that lines of concurrent shells never interleave and
+ * none is written to a file that is being compacted. */
+int linenoiseHistoryAdd(const char *line) {
+  if (!historyAdd(line))
+    return 0;
+  if (history_fd == -1 || historyLock() == -1)
+    return 1;
+
+  struct iovec iov[2] = {{(void *)line, strlen(line)}, {"\n", 1}};
+  if (writev(history_fd, iov, 2) != -1 &&
+      ++history_file_lines >
+          (long)history_max_len * LINENOISE_HISTORY_COMPACT_FACTOR)
+    historyCompact();
+  flock(history_fd, LOCK_UN);
   return 1;
 }
 
+/* Return the newest history entry that starts with 'prefix', or NULL if
+ * there is none (or 'prefix' is empty). This is meant for hints, so it
+ * only costs a walk of 'prefix' through the history's prefix index. */
+const char *linenoiseHistoryFindPrefix(const char *prefix) {
+  uint32_t node = 0;
+  const char *p;
+
+  if (prefix_nodes == NULL || *prefix == '\0')
+    return NULL;
+  for (p = prefix; *p; p++)
+    if ((node = prefixChild(node, *p)) == 0)
+      return NULL;
+
+  long seq = prefix_nodes[node].newest;
+  if (seq < history_seq || seq >= history_seq + history_len)
+    return NULL;
+  /* An entry edited while browsing the history may no longer match. */
+  const char *entry = historyEntry(seq);
+  return strncmp(entry, prefix, p - prefix) == 0 ? entry : NULL;
+}
+
+/* Switch to append mode: from now on every line passed to
+ * linenoiseHistoryAdd() is appended to 'filename' as it is added, so the
+ * history survives a crash and concurrent shells don't overwrite each
+ * other, and linenoiseHistorySave() is no longer needed. Call it after
+ * linenoiseHistoryLoad() of the same file. On success 0 is returned,
+ * otherwise -1. */
+int linenoiseHistorySetAppendFile(const char *filename) {
+  mode_t old_umask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+  int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+  umask(old_umask);
+  if (fd == -1)
+    return -1;
+
+  char *name = strdup(filename);
+  if (name == NULL) {
+    close(fd);
+    return -1;
+  }
+  if (history_fd != -1)
+    close(history_fd);
+  free(history_file);
+  history_fd = fd;
+  history_file = name;
+  return 0;
+}
+
 /* Set the maximum length for the history. This function can be called even
  * if there is already some history, the function will make sure to retain
  * just the latest 'len' elements if the new history length value is smaller
@@ -1767,6 +2795,7 @@ int linenoiseHistorySetMaxLen(int len) {
     return 0;
   if (history) {
     int tocopy = history_len;
+    int j;
 
     new = malloc(sizeof(char *) * len);
     if (new == NULL)
@@ -1774,16 +2803,18 @@ int linenoiseHistorySetMaxLen(int len) {
 
     /* If we can't copy everything, free the elements we'll not use. */
     if (len < tocopy) {
-      int j;
-
       for (j = 0; j < tocopy - len; j++)
-        free(history[j]);
+        historyFree(*historySlot(j));
+      history_seq += tocopy - len;
       tocopy = len;
     }
+    /* Unwrap the kept entries to the start of the new buffer. */
     memset(new, 0, sizeof(char *) * len);
-    memcpy(new, history + (history_len - tocopy), sizeof(char *) * tocopy);
+    for (j = 0; j < tocopy; j++)
+      new[j] = *historySlot(history_len - tocopy + j);
     free(history);
     history = new;
+    history_start = 0;
   }
   history_max_len = len;
   if (history_len > history_max_len)
@@ -1804,7 +2835,7 @@ int linenoiseHistorySave(const char *filename) {
     return -1;
   fchmod(fileno(fp), S_IRUSR | S_IWUSR);
   for (j = 0; j < history_len; j++)
-    fprintf(fp, "%s\n", history[j]);
+    fprintf(fp, "%s\n", *historySlot(j));
   fclose(fp);
   return 0;
 }
@@ -1812,25 +2843,70 @@ int linenoiseHistorySave(const char *filename) {
 /* Load the history from the specified file. If the file does not exist
  * zero is returned and no operation is performed.
  *
+ * The file is mapped and scanned backward from its end for the last
+ * history_max_len lines, so lines that would be evicted right away are never
+ * read. Those lines are copied into a single allocation (history_block)
+ * instead of one strdup() each.
+ *
  * If the file exists and the operation succeeded 0 is returned, otherwise
  * on error -1 is returned. */
 int linenoiseHistoryLoad(const char *filename) {
-  FILE *fp = fopen(filename, "r");
-  char buf[LINENOISE_MAX_LINE];
+  size_t size;
+  long lines, more;
+  int err;
+  char *data = historyMap(filename, &size, &err);
+
+  history_file_lines = 0;
+  if (data == NULL)
+    return err ? -1 : 0;
+  if (!historyInit()) {
+    munmap(data, size);
+    return 0;
+  }
 
-  if (fp == NULL)
+  size_t start = historyTail(data, size, history_max_len, &lines);
+  /* Count on just far enough to know whether append mode should compact
+   * the file on its next write. */
+  historyTail(data, start,
+              (long)history_max_len * LINENOISE_HISTORY_COMPACT_FACTOR, &more);
+  history_file_lines = lines + more;
+
+  size_t blocksize = size - start + 1;
+  char *block = malloc(blocksize);
+  if (block == NULL) {
+    munmap(data, size);
     return -1;
+  }
+  memcpy(block, data + start, size - start);
+  block[blocksize - 1] = '\n';
+  munmap(data, size);
+
+  /* A second load (there is already a block) falls back to copies. */
+  int own_block = history_block == NULL;
+  if (own_block) {
+    history_block = block;
+    history_block_size = blocksize;
+    history_block_refs = 1; /* Held until the loop below is done. */
+  }
 
-  while (fgets(buf, LINENOISE_MAX_LINE, fp) != NULL) {
-    char *p;
-
-    p = strchr(buf, '\r');
-    if (!p)
-      p = strchr(buf, '\n');
-    if (p)
-      *p = '\0';
-    linenoiseHistoryAdd(buf);
+  /* The extra '\n' at the end stops memchr() for a last line without one. */
+  char *end = block + blocksize - 1;
+  for (char *line = block; line < end;) {
+    char *nl = memchr(line, '\n', end - line + 1);
+    char *cr = memchr(line, '\r', nl - line);
+    *(cr ? cr : nl) = '\0';
+    if (!own_block) {
+      historyAdd(line);
+    } else if (!historyIsDup(line)) {
+      history_block_refs++;
+      historyPush(line);
+    }
+    line = nl + 1;
   }
-  fclose(fp);
+
+  if (own_block)
+    historyFree(block);
+  else
+    free(block);
   return 0;
 }
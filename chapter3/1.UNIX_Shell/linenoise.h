@@ -60,13 +60,36 @@ struct linenoiseState {
     size_t buflen;      /* Edited line buffer size. */
     const char *prompt; /* Prompt to display. */
     size_t plen;        /* Prompt length. */
+    size_t pwidth;      /* Prompt display width. */
     size_t pos;         /* Current cursor position. */
+    size_t poscol;      /* Display width of the line up to the cursor. */
     size_t oldpos;      /* Previous refresh cursor position. */
     size_t len;         /* Current edited line length. */
+    size_t lencol;      /* Display width of the line. */
     size_t cols;        /* Number of columns in terminal. */
     size_t oldrows;     /* Rows used by last refrehsed line (multiline mode) */
     int oldrpos;        /* Cursor row from last refresh (for multiline clearing). */
     int history_index;  /* The history index we are currently editing. */
+    int in_search;      /* The user pressed Ctrl-R and we are now in reverse
+                         * search mode, so input goes to the query. */
+    char search[64];    /* Reverse search query. */
+    size_t search_len;  /* Reverse search query length. */
+    long search_seq;    /* History entry the search is showing. */
+    char *search_orig;  /* Line to restore if the search is cancelled. */
+    const char *orig_prompt; /* Prompt to restore when the search ends. */
+    size_t orig_plen;   /* Its length. */
+    char *frame;        /* Last rendered prompt, line and hint (single line
+                         * mode), so a refresh only writes what changed. */
+    size_t frame_len;   /* Bytes in frame. */
+    size_t frame_textlen; /* Bytes of prompt and line; the hint follows. */
+    size_t frame_width; /* Columns covered by frame. */
+    size_t frame_poscol; /* Cursor column after the last refresh. */
+    int frame_valid;    /* The screen still shows frame. */
+    size_t frame_cap;   /* Allocated size of frame. */
+    char *spare;        /* Buffer the next frame is rendered into. */
+    size_t spare_cap;
+    char *out;          /* Buffer for the output of a refresh. */
+    size_t out_cap;
 };
 
 typedef struct linenoiseCompletions {
@@ -99,6 +122,8 @@ int linenoiseHistoryAdd(const char *line);
 int linenoiseHistorySetMaxLen(int len);
 int linenoiseHistorySave(const char *filename);
 int linenoiseHistoryLoad(const char *filename);
+int linenoiseHistorySetAppendFile(const char *filename);
+const char *linenoiseHistoryFindPrefix(const char *prefix);
 
 /* Other utilities. */
 void linenoiseClearScreen(void);
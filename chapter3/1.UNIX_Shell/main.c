@@ -1,11 +1,16 @@
+#include "builtins.h"
+#include "complete.h"
+#include "jobs.h"
 #include "linenoise.h"
 #include "shell.h"
+#include <errno.h>
 #include <pwd.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #define HISTORY_FILENAME ".osh_history"
 #define MAX_HISTORY_LEN 500
+#define READ_CHUNK (64 * 1024)
 
 // Helper function to get full history path
 char *get_history_path() {
@@ -29,104 +34,223 @@ char *get_history_path() {
   return HISTORY_FILENAME;
 }
 
-int main() {
-  // Setup linenoise
-  linenoiseHistorySetMaxLen(MAX_HISTORY_LEN);
-  char *history_path = get_history_path();
-  linenoiseHistoryLoad(history_path);
+// Buffered line reader for script mode. Reads READ_CHUNK bytes at a time
+// with read(2) and hands out lines in place, so a script costs one syscall
+// per 64 KB instead of going through linenoise one byte at a time.
+struct line_reader {
+  int fd;
+  char *buf;
+  size_t cap;   // size of buf
+  size_t start; // first unconsumed byte
+  size_t end;   // end of the data read so far
+  bool eof;
+};
 
-  bool should_run = true;
-  char *line;
-  struct Command cmd = {{0},  {0},   {0},  false, false, false,
-                        NULL, false, NULL, false, {0},   0};
-
-  while (should_run) {
-    line = linenoise("osh> ");
-
-    // Check for EOF (Ctrl+D)
-    if (line == NULL) {
-      printf("\n");
-      break;
+// Return the next line without its newline, or NULL at end of input. The
+// line stays valid until the next call.
+static char *read_line(struct line_reader *r) {
+  while (true) {
+    char *nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+    if (nl != NULL) {
+      char *line = r->buf + r->start;
+      *nl = '\0';
+      r->start = nl - r->buf + 1;
+      return line;
     }
-
-    // Check for empty input
-    if (line[0] == '\0') {
-      free(line);
-      continue;
+    if (r->eof) {
+      // Last line without a trailing newline
+      if (r->start == r->end)
+        return NULL;
+      char *line = r->buf + r->start;
+      r->buf[r->end] = '\0';
+      r->start = r->end;
+      return line;
     }
 
-    // Copy to command buffer
-    if (strlen(line) >= sizeof(cmd.input_buf)) {
-      printf("Error: Command too long (max %d characters)\n",
-             (int)sizeof(cmd.input_buf) - 1);
-      free(line);
-      continue;
+    // Move the partial line to the front and read more after it, growing
+    // the buffer for lines longer than it. One byte is kept for the '\0'.
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+    if (r->cap - r->end < READ_CHUNK / 2) {
+      char *buf = realloc(r->buf, r->cap * 2);
+      if (buf == NULL) {
+        printf("Error: Out of memory\n");
+        return NULL;
+      }
+      r->buf = buf;
+      r->cap *= 2;
     }
-    strcpy(cmd.input_buf, line);
-
-    // Check if it's a built-in command before adding to history
-    bool is_builtin = (strcmp(line, "exit") == 0 ||
-                       strcmp(line, "clear") == 0 || strcmp(line, "!!") == 0);
-
-    free(line);
-
-    // Handle exit
-    if (strcmp(cmd.input_buf, "exit") == 0) {
-      should_run = false;
+    ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+    if (n == -1 && errno == EINTR)
       continue;
-    }
+    if (n <= 0)
+      r->eof = true;
+    else
+      r->end += n;
+  }
+}
 
-    // Handle clear command
-    if (strcmp(cmd.input_buf, "clear") == 0) {
-      linenoiseClearScreen();
-      continue;
-    }
+// Run one line of input: "!!", history, then parse and execute.
+static void run_line(struct Command *cmd, const char *line, bool interactive) {
+  // Check for empty input
+  if (line[0] == '\0')
+    return;
 
-    // Run last command
-    if (strcmp(cmd.input_buf, "!!") == 0) {
-      if (cmd.last_command_buf[0] == '\0') {
-        printf("Error: No commands in history.\n");
-        continue;
-      } else {
-        strcpy(cmd.input_buf, cmd.last_command_buf);
-        printf("Running command: %s\n", cmd.last_command_buf);
-      }
-    }
+  // Copy to command buffer
+  reset_command(cmd);
+  if (set_command_input(cmd, line) == -1)
+    return;
 
-    // Save the command to cmd.last_command_buf before parsing
-    memset(cmd.last_command_buf, 0, sizeof(cmd.last_command_buf));
-    strcpy(cmd.last_command_buf, cmd.input_buf);
+  // Check if it's a built-in command before adding to history
+  bool skip_history = (strcmp(cmd->input_buf, "exit") == 0 ||
+                       strcmp(cmd->input_buf, "clear") == 0 ||
+                       strcmp(cmd->input_buf, "!!") == 0);
 
-    // Add to history (after processing !! but before execution)
-    // Don't add built-in commands to history
-    if (!is_builtin) {
-      linenoiseHistoryAdd(cmd.input_buf);
+  // Run last command
+  if (strcmp(cmd->input_buf, "!!") == 0) {
+    if (cmd->last_command_buf == NULL) {
+      printf("Error: No commands in history.\n");
+      return;
+    } else if (set_command_input(cmd, cmd->last_command_buf) == -1) {
+      return;
+    } else {
+      printf("Running command: %s\n", cmd->last_command_buf);
     }
+  }
 
-    // Tokenize and parse
-    if (tokenize_input(&cmd) == -1) {
-      reset_command(&cmd);
-      continue;
-    }
+  // Save the command to cmd->last_command_buf before parsing
+  free(cmd->last_command_buf);
+  cmd->last_command_buf = strdup(cmd->input_buf);
 
-    if (parse_input(&cmd) == -1) {
-      reset_command(&cmd);
-      continue;
-    }
+  // Add to history (after processing !! but before execution)
+  // Don't add exit, clear or !! to history
+  if (interactive && !skip_history) {
+    linenoiseHistoryAdd(cmd->input_buf);
+  }
+
+  // Parse
+  if (parse_input(cmd) == -1) {
+    jobs_set_status(2);
+    reset_command(cmd);
+    return;
+  }
 
 #ifdef DEBUG
-    debug_command(&cmd);
+  debug_command(cmd);
 #endif
 
-    // Execute command
-    execute_command(&cmd);
+  // Execute command (builtins run in the shell itself); this also sets $?
+  // and $PIPESTATUS
+  execute_command(cmd);
+
+  // Reset command structure for next iteration
+  reset_command(cmd);
+}
+
+// Non-interactive mode: run every line from 'fd' with no line editing and
+// no history.
+static void run_script(struct Command *cmd, int fd) {
+  struct line_reader reader = {fd, malloc(READ_CHUNK), READ_CHUNK, 0, 0, false};
+  char *line;
+
+  if (reader.buf == NULL) {
+    printf("Error: Out of memory\n");
+    jobs_set_status(1);
+    return;
+  }
+  while (!builtin_exit_requested() && (line = read_line(&reader)) != NULL) {
+    run_line(cmd, line, false);
+    jobs_notify();
+  }
+  free(reader.buf);
+}
+
+// linenoise hints callback: the rest of the newest history entry that
+// starts with the line typed so far, shown in gray after the cursor
+static char *history_hint(const char *buf, int *color, int *bold) {
+  const char *entry = linenoiseHistoryFindPrefix(buf);
+  if (entry == NULL || entry[strlen(buf)] == '\0')
+    return NULL;
+  *color = 90;
+  *bold = 0;
+  return (char *)entry + strlen(buf);
+}
+
+static void run_interactive(struct Command *cmd) {
+  // Setup linenoise
+  linenoiseHistorySetMaxLen(MAX_HISTORY_LEN);
+  char *history_path = get_history_path();
+  linenoiseHistoryLoad(history_path);
+  // Append each command to the history file as it is entered, so a crash
+  // loses nothing and concurrent shells don't clobber each other's history
+  bool append_history = linenoiseHistorySetAppendFile(history_path) == 0;
+  linenoiseSetCompletionCallback(complete_line);
+  linenoiseSetHintsCallback(history_hint);
+
+  while (!builtin_exit_requested()) {
+    // Report background jobs that finished or stopped
+    jobs_notify();
+    char *line = linenoise("osh> ");
 
-    // Reset command structure for next iteration
-    reset_command(&cmd);
+    // Check for EOF (Ctrl+D)
+    if (line == NULL) {
+      printf("\n");
+      break;
+    }
+    run_line(cmd, line, true);
+    free(line);
   }
 
-  // Save history on exit
-  linenoiseHistorySave(history_path);
+  // Without append mode, save history on exit
+  if (!append_history)
+    linenoiseHistorySave(history_path);
+}
+
+// Usage:
+//   shell               interactive, or a script on stdin if it isn't a tty
+//   shell -c commands   run 'commands' (one per line)
+//   shell script.osh    run the commands in a file
+// In the non-interactive modes the exit status is the last command's.
+int main(int argc, char *argv[]) {
+  // OSH_SPAWN=fork selects the plain fork() backend
+  const char *spawn_env = getenv("OSH_SPAWN");
+  if (spawn_env != NULL && strcmp(spawn_env, "fork") == 0)
+    set_spawn_backend(SPAWN_FORK);
+
+  struct Command cmd = {0};
+  bool interactive = argc == 1 && isatty(STDIN_FILENO);
+  jobs_init(interactive);
+
+  if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+    if (argc < 3) {
+      fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+      return 2;
+    }
+    char *p = argv[2];
+    while (p != NULL && !builtin_exit_requested()) {
+      char *nl = strchr(p, '\n');
+      if (nl != NULL)
+        *nl = '\0';
+      run_line(&cmd, p, false);
+      jobs_notify();
+      p = nl != NULL ? nl + 1 : NULL;
+    }
+  } else if (argc > 1) {
+    // O_CLOEXEC: the script must not leak into the commands it runs
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      perror(argv[1]);
+      return 127;
+    }
+    run_script(&cmd, fd);
+    close(fd);
+  } else if (!isatty(STDIN_FILENO)) {
+    run_script(&cmd, STDIN_FILENO);
+  } else {
+    run_interactive(&cmd);
+  }
 
-  return 0;
+  free_command(&cmd);
+  return jobs_last_status();
 }
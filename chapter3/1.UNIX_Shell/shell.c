@@ -1,231 +1,680 @@
+#define _GNU_SOURCE // pipe2()
 #include "shell.h"
+#include "builtins.h"
+#include "hash.h"
+#include "jobs.h"
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
 #define READ_END 0
 #define WRITE_END 1
 
+extern char **environ;
+
 #ifdef DEBUG
 void debug_command(struct Command *cmd) {
   // Debug Command
-  printf("DEBUG: Arguments:\n");
-  for (int i = 0; i < cmd->args_length; i++) {
-    printf("DEBUG: args[%d]: %s\n", i, cmd->args[i]);
-  }
   printf("DEBUG: Background: %s\n", cmd->run_background ? "yes" : "no");
-  printf("DEBUG: Redirect In: %s\n", cmd->redirect_in ? "yes" : "no");
-  printf("DEBUG: Redirect In File: %s\n",
-         cmd->redirect_in_file ? cmd->redirect_in_file : "none");
-  printf("DEBUG: Redirect Out: %s\n", cmd->redirect_out ? "yes" : "no");
-  printf("DEBUG: Redirect Out File: %s\n",
-         cmd->redirect_out_file ? cmd->redirect_out_file : "none");
-  printf("DEBUG: Num of pipes: %d\n", cmd->num_pipes);
-  printf("DEBUG: Pipe command count: %d\n", cmd->pipe_cmd_count);
-  for (int i = 0; i < cmd->pipe_cmd_count; i++) {
-    printf("DEBUG: pipe_cmds[%d] full command: ", i);
-    for (int j = 0; cmd->pipe_cmds[i][j] != NULL; j++) {
-      printf("%s ", cmd->pipe_cmds[i][j]);
+  printf("DEBUG: Timed: %s\n", cmd->timed ? "yes" : "no");
+  printf("DEBUG: Stage count: %d\n", cmd->stage_count);
+  for (int i = 0; i < cmd->stage_count; i++) {
+    struct Stage *stage = &cmd->stages[i];
+    printf("DEBUG: stages[%d] full command: ", i);
+    for (int j = 0; j < stage->argc; j++) {
+      printf("%s ", stage->argv[j]);
     }
     printf("\n");
+    printf("DEBUG: stages[%d] Redirect In File: %s\n", i,
+           stage->in_file ? stage->in_file : "none");
+    printf("DEBUG: stages[%d] Redirect Out File: %s\n", i,
+           stage->out_file ? stage->out_file : "none");
   }
 }
 #endif
 
-int tokenize_input(struct Command *cmd) {
-  int i = 0;
-  int pos = 0;
-  char *str = cmd->input_buf;
+// Copy 'line' into the command's arena as the line to parse.
+int set_command_input(struct Command *cmd, const char *line) {
+  cmd->input_buf = arena_strdup(&cmd->arena, line);
+  if (cmd->input_buf == NULL) {
+    printf("Error: Out of memory\n");
+    return -1;
+  }
+  return 0;
+}
 
-  while (str[pos] != '\0') {
-    // Skip leading spaces
-    while (str[pos] == ' ')
-      pos++;
-    if (str[pos] == '\0')
-      break;
+enum lex_state {
+  LEX_BLANK,  // between words
+  LEX_WORD,   // inside an unquoted part of a word
+  LEX_SQUOTE, // inside '...'
+  LEX_DQUOTE, // inside "..."
+};
 
-    int start = pos;
+enum pending_redirect { REDIRECT_NONE, REDIRECT_IN, REDIRECT_OUT };
 
-    // Check if this token starts with a quote
-    if (str[pos] == '"' || str[pos] == '\'') {
-      char quote = str[pos];
-      pos++; // Skip opening quote
-      start = pos;
+static bool is_word_char(char c) {
+  switch (c) {
+  case '\0':
+  case ' ':
+  case '\t':
+  case '|':
+  case '<':
+  case '>':
+  case '&':
+  case '"':
+  case '\'':
+    return false;
+  default:
+    return true;
+  }
+}
 
-      // Find closing quote
-      while (str[pos] != '\0' && str[pos] != quote)
-        pos++;
+static bool check_redirect_target(enum pending_redirect redirect) {
+  if (redirect == REDIRECT_IN) {
+    printf("Error: No input file specified for redirection\n");
+    return false;
+  }
+  if (redirect == REDIRECT_OUT) {
+    printf("Error: No output file specified for redirection\n");
+    return false;
+  }
+  return true;
+}
 
-      if (str[pos] != quote) {
-        printf("Error: Unclosed quote\n");
-        return -1;
-      }
+// Expand the variable named at 'p' (just past a '$'): "?" is the last exit
+// status, "PIPESTATUS" the exit statuses of every stage of the last
+// pipeline, and anything else comes from the environment (empty if unset).
+// Stores the length of the name in *len. Returns NULL if no name follows,
+// in which case the '$' is an ordinary character.
+static const char *lookup_var(struct arena *a, const char *p, size_t *len) {
+  if (*p == '?') {
+    char *buf = arena_alloc(a, 12);
+    *len = 1;
+    if (buf == NULL)
+      return "";
+    snprintf(buf, 12, "%d", jobs_last_status());
+    return buf;
+  }
+  if (!isalpha((unsigned char)*p) && *p != '_')
+    return NULL;
 
-      str[pos] = '\0'; // Replace closing quote with null
-      cmd->args[i++] = &str[start];
-#ifdef DEBUG
-      printf("DEBUG: Token: %s\n", &str[start]);
-#endif
-      pos++;
-    } else {
-      // Regular token - find next space
-      while (str[pos] != '\0' && str[pos] != ' ')
-        pos++;
+  size_t n = 1;
+  while (isalnum((unsigned char)p[n]) || p[n] == '_')
+    n++;
+  *len = n;
 
-      if (str[pos] == ' ') {
-        str[pos] = '\0';
-        pos++;
-      }
-      cmd->args[i++] = &str[start];
-#ifdef DEBUG
-      printf("DEBUG: Token: %s\n", &str[start]);
-#endif
-    }
+  if (n == 10 && strncmp(p, "PIPESTATUS", n) == 0) {
+    int count;
+    const int *status = jobs_pipestatus(&count);
+    char *buf = arena_alloc(a, count * 12 + 1);
+    if (buf == NULL)
+      return "";
+    char *q = buf;
+    *q = '\0';
+    for (int i = 0; i < count; i++)
+      q += sprintf(q, i == 0 ? "%d" : " %d", status[i]);
+    return buf;
   }
 
-  cmd->args[i] = NULL;
-  cmd->args_length = i;
-  return i;
+  char *name = arena_strndup(a, p, n);
+  const char *value = name != NULL ? getenv(name) : NULL;
+  return value != NULL ? value : "";
 }
 
+// Split cmd->input_buf into pipeline stages in a single pass. Each character
+// is looked at once: words are copied (with their quotes removed) into an
+// arena buffer and handed straight to the current stage as an argument or as
+// the file of a pending "<"/">". Operators don't need surrounding spaces, so
+// "ls|wc" and "cat<f" work. "$NAME", "$?" and "$PIPESTATUS" are expanded
+// outside single quotes, and a leading "time" keyword sets cmd->timed.
 int parse_input(struct Command *cmd) {
-  // Check if last argument is "&" for background execution
-  if (cmd->args_length > 0 &&
-      strcmp(cmd->args[cmd->args_length - 1], "&") == 0) {
-    cmd->run_background = true;
-    cmd->args[cmd->args_length - 1] = NULL;
-    cmd->args_length--;
-  }
-
-  if (cmd->args_length > 0) {
-    // Add first command to pipe_cmds array
-    cmd->pipe_cmds[0] = &cmd->args[0];
-    cmd->pipe_cmd_count++;
-    // Check if args contains "<" or ">" for input/output redirection
-    for (int i = 0; i < cmd->args_length; i++) {
-
-      if (cmd->args[i] == NULL)
-        continue;
+  const char *in = cmd->input_buf;
+  size_t n = strlen(in);
+  struct arena *a = &cmd->arena;
+  size_t len;
 
-      if (!cmd->redirect_in && strcmp(cmd->args[i], "<") == 0) {
-        if (i + 1 >= cmd->args_length || cmd->args[i + 1] == NULL) {
-          printf("Error: No input file specified for redirection\n");
-          return -1;
-        }
-        cmd->redirect_in = true;
-        cmd->redirect_in_file = cmd->args[i + 1];
-        cmd->args[i] = NULL;
-        cmd->args[i + 1] = NULL;
-
-      } else if (!cmd->redirect_out && strcmp(cmd->args[i], ">") == 0) {
-        if (i + 1 >= cmd->args_length || cmd->args[i + 1] == NULL) {
-          printf("Error: No output file specified for redirection\n");
-          return -1;
-        }
-        cmd->redirect_out = true;
-        cmd->redirect_out_file = cmd->args[i + 1];
-        cmd->args[i] = NULL;
-        cmd->args[i + 1] = NULL;
+  // Room for what the "$" expansions add to the words
+  size_t expanded = 0;
+  for (const char *p = strchr(in, '$'); p != NULL; p = strchr(p + 1, '$')) {
+    const char *value = lookup_var(a, p + 1, &len);
+    if (value != NULL)
+      expanded += strlen(value);
+  }
+
+  // Upper bounds from the line length: every word or "|" takes at least one
+  // input character (argv slots, including each stage's NULL), words are at
+  // least one character apart (word bytes plus terminators), and a stage is
+  // at least two characters with its "|".
+  char **argv = arena_alloc(a, (n + 2) * sizeof(char *));
+  char *out = arena_alloc(a, n + n / 2 + 2 + expanded);
+  cmd->stages = arena_alloc(a, (n / 2 + 1) * sizeof(struct Stage));
+  if (argv == NULL || out == NULL || cmd->stages == NULL) {
+    printf("Error: Out of memory\n");
+    return -1;
+  }
+
+  enum lex_state state = LEX_BLANK;
+  enum pending_redirect redirect = REDIRECT_NONE;
+  struct Stage *stage = &cmd->stages[0];
+  char *word = NULL;
+  bool word_quoted = false; // "" and '' make a word even when empty
+  const char *value;
+
+  cmd->stage_count = 1;
+  *stage = (struct Stage){argv, 0, NULL, NULL};
+
+  for (size_t i = 0;; i++) {
+    char c = in[i];
+
+    if (state == LEX_SQUOTE || state == LEX_DQUOTE) {
+      if (c == '\0') {
+        printf("Error: Unclosed quote\n");
+        return -1;
       }
+      if (c == (state == LEX_SQUOTE ? '\'' : '"'))
+        state = LEX_WORD;
+      else if (state == LEX_DQUOTE && c == '$' &&
+               (value = lookup_var(a, in + i + 1, &len)) != NULL) {
+        out = stpcpy(out, value);
+        i += len;
+      } else
+        *out++ = c;
+      continue;
     }
 
-    // Compact the args array by removing NULLs
-    int write_idx = 0;
-    for (int read_idx = 0; read_idx < cmd->args_length; read_idx++) {
-      if (cmd->args[read_idx] != NULL) {
-        cmd->args[write_idx++] = cmd->args[read_idx];
+    // "#" at the start of a word comments out the rest of the line
+    if (state == LEX_BLANK && c == '#')
+      c = '\0';
+
+    if (c == '"' || c == '\'' || is_word_char(c)) {
+      if (state == LEX_BLANK) {
+        word = out;
+        word_quoted = false;
+      }
+      if (c == '$' && (value = lookup_var(a, in + i + 1, &len)) != NULL) {
+        out = stpcpy(out, value);
+        i += len;
+        state = LEX_WORD;
+      } else if (is_word_char(c)) {
+        *out++ = c;
+        state = LEX_WORD;
+      } else {
+        state = c == '"' ? LEX_DQUOTE : LEX_SQUOTE;
+        word_quoted = true;
       }
+      continue;
     }
-    cmd->args[write_idx] = NULL;
-    cmd->args_length = write_idx;
-
-    // Parse pipes
-    for (int i = 0; i < cmd->args_length; i++) {
-      if (strcmp(cmd->args[i], "|") == 0) {
-        cmd->pipe_cmds[cmd->pipe_cmd_count++] = &cmd->args[i + 1];
-        cmd->args[i] = NULL;
-        cmd->num_pipes++;
+
+    // A blank, an operator or the end of the line finishes the current word
+    if (state == LEX_WORD) {
+      *out++ = '\0';
+#ifdef DEBUG
+      printf("DEBUG: Token: %s\n", word);
+#endif
+      if (word[0] == '\0' && !word_quoted) {
+        // An unquoted expansion of an empty or unset variable is no word
+        out = word;
+      } else if (!word_quoted && redirect == REDIRECT_NONE &&
+                 cmd->stage_count == 1 && stage->argc == 0 && !cmd->timed &&
+                 strcmp(word, "time") == 0) {
+        cmd->timed = true;
+        out = word;
+      } else if (redirect == REDIRECT_IN)
+        stage->in_file = word;
+      else if (redirect == REDIRECT_OUT)
+        stage->out_file = word;
+      else
+        stage->argv[stage->argc++] = word;
+      if (out != word)
+        redirect = REDIRECT_NONE;
+      state = LEX_BLANK;
+    }
+
+    switch (c) {
+    case ' ':
+    case '\t':
+      break;
+    case '<':
+    case '>':
+      if (!check_redirect_target(redirect))
+        return -1;
+      redirect = c == '<' ? REDIRECT_IN : REDIRECT_OUT;
+      break;
+    case '|':
+      if (!check_redirect_target(redirect))
+        return -1;
+      if (stage->argc == 0) {
+        printf("Error: Missing command\n");
+        return -1;
+      }
+      stage->argv[stage->argc] = NULL;
+      char **next_argv = stage->argv + stage->argc + 1;
+      stage = &cmd->stages[cmd->stage_count++];
+      *stage = (struct Stage){next_argv, 0, NULL, NULL};
+      break;
+    case '&':
+      // Only allowed as the last thing on the line
+      while (in[i + 1] == ' ' || in[i + 1] == '\t')
+        i++;
+      if (in[i + 1] != '\0') {
+        printf("Error: '&' is only allowed at the end of a command\n");
+        return -1;
       }
+      cmd->run_background = true;
+      break;
+    case '\0':
+      if (!check_redirect_target(redirect))
+        return -1;
+      stage->argv[stage->argc] = NULL;
+      if (stage->argc == 0) {
+        // A blank line is not an error, "ls |" or "< f" is
+        if (cmd->stage_count == 1 && stage->in_file == NULL &&
+            stage->out_file == NULL && !cmd->run_background) {
+          cmd->stage_count = 0;
+          return 0;
+        }
+        printf("Error: Missing command\n");
+        return -1;
+      }
+      return 0;
     }
   }
+}
+
+/* Backend used to start pipeline stages. posix_spawn() lets libc use
+ * clone(CLONE_VM|CLONE_VFORK), so the parent's page tables are never copied;
+ * fork() is kept as a fallback for platforms (or debugging sessions) where
+ * that is not wanted. */
+static enum spawn_backend spawn_backend = SPAWN_POSIX;
+
+void set_spawn_backend(enum spawn_backend backend) { spawn_backend = backend; }
+
+static void report_spawn_error(const char *what, int err) {
+  if (err == ENOENT)
+    fprintf(stderr, "%s: command not found\n", what);
+  else
+    fprintf(stderr, "%s: %s\n", what, strerror(err));
+}
+
+// posix_spawn_file_actions_addtcsetpgrp_np() lets the child take the
+// terminal itself, before it can run into SIGTTIN.
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
+
+// Start one stage with posix_spawn(). in_fd/out_fd (pipe ends or redirect
+// files, -1 for none) are dup2'd onto stdin/stdout by the file actions.
+// 'pgid' is the process group to join: 0 for a new one, -1 to stay in ours.
+// Returns the pid, or -1 with the error in *err.
+static pid_t spawn_stage_posix(const char *path, char **argv, int in_fd,
+                               int out_fd, pid_t pgid, bool foreground,
+                               int *err) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  short flags = POSIX_SPAWN_SETSIGMASK;
+  sigset_t sigs;
+  pid_t pid;
+
+  posix_spawnattr_init(&attr);
+  // SIGCHLD is blocked while stages are started; the stage starts clean
+  sigemptyset(&sigs);
+  posix_spawnattr_setsigmask(&attr, &sigs);
+  if (job_control_enabled()) {
+    job_default_signals(&sigs);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    flags |= POSIX_SPAWN_SETSIGDEF;
+  }
+  if (pgid != -1) {
+    posix_spawnattr_setpgroup(&attr, pgid);
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  posix_spawn_file_actions_init(&actions);
+#ifdef HAVE_SPAWN_TCSETPGRP
+  if (pgid == 0 && foreground)
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#else
+  (void)foreground;
+#endif
+  if (in_fd != -1)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  if (out_fd != -1)
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+  *err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  return *err == 0 ? pid : -1;
+}
+
+// close_range() closes every descriptor above stderr in one call
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+#define HAVE_CLOSE_RANGE 1
+#endif
+
+// Start one stage with a plain fork() + execv(). A builtin that forks runs
+// in the child instead of the execv().
+static pid_t spawn_stage_fork(const char *path, char **argv, int in_fd,
+                              int out_fd, pid_t pgid, bool foreground,
+                              const struct builtin *builtin) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return -1;
+  }
+  if (pid > 0) {
+    // Set the group from both sides so neither has to wait for the other
+    if (pgid != -1)
+      setpgid(pid, pgid != 0 ? pgid : pid);
+    return pid;
+  }
+
+  // child process
+  sigset_t sigs;
+  if (pgid != -1) {
+    setpgid(0, pgid);
+    if (pgid == 0 && foreground)
+      tcsetpgrp(STDIN_FILENO, getpid());
+  }
+  if (job_control_enabled()) {
+    job_default_signals(&sigs);
+    for (int sig = 1; sig < NSIG; sig++)
+      if (sigismember(&sigs, sig) == 1)
+        signal(sig, SIG_DFL);
+  }
+  sigemptyset(&sigs);
+  sigprocmask(SIG_SETMASK, &sigs, NULL);
+
+  if (in_fd != -1)
+    dup2(in_fd, STDIN_FILENO);
+  if (out_fd != -1)
+    dup2(out_fd, STDOUT_FILENO);
+
+  if (builtin != NULL) {
+    // No exec will close the O_CLOEXEC pipe ends, and a write end left
+    // open here would keep this stage's own input from ever reaching EOF
+#ifdef HAVE_CLOSE_RANGE
+    close_range(3, ~0U, 0);
+#else
+    for (int fd = 3; fd < sysconf(_SC_OPEN_MAX); fd++)
+      close(fd);
+#endif
+    int status = builtin->func(argv);
+    fflush(stdout);
+    _exit(status);
+  }
+  execv(path, argv);
+  // The child can't update the parent's hash table, so if the hashed binary
+  // is gone just fall back to a full PATH search.
+  if (errno == ENOENT && path != argv[0])
+    execvp(argv[0], argv);
+  report_spawn_error(argv[0], errno);
+  _exit(127);
+}
+
+static pid_t spawn_stage(char **argv, int in_fd, int out_fd, pid_t pgid,
+                         bool foreground) {
+  const struct builtin *builtin = builtin_lookup(argv[0]);
+  if (builtin != NULL && builtin->forks)
+    return spawn_stage_fork(NULL, argv, in_fd, out_fd, pgid, foreground,
+                            builtin);
+
+  const char *path = hash_lookup(argv[0]);
+  pid_t pid;
+  int err;
+
+  if (path == NULL) {
+    report_spawn_error(argv[0], ENOENT);
+    errno = ENOENT;
+    return -1;
+  }
+  if (spawn_backend == SPAWN_FORK)
+    return spawn_stage_fork(path, argv, in_fd, out_fd, pgid, foreground,
+                            NULL);
+
+  pid = spawn_stage_posix(path, argv, in_fd, out_fd, pgid, foreground, &err);
+  if (pid == -1 && err == ENOENT && path != argv[0]) {
+    // The hashed binary went away: forget it and search PATH again.
+    hash_forget(argv[0]);
+    path = hash_lookup(argv[0]);
+    if (path != NULL)
+      pid = spawn_stage_posix(path, argv, in_fd, out_fd, pgid, foreground,
+                              &err);
+  }
+  if (pid == -1) {
+    report_spawn_error(argv[0], err);
+    errno = err;
+  }
+  return pid;
+}
+
+// Open a redirect file in the parent. Like the pipe ends it is O_CLOEXEC, so
+// only the dup2'd copy survives into the stage.
+static int open_redirect(const char *file, int flags) {
+  int fd = open(file, flags | O_CLOEXEC, 0644);
+  if (fd == -1)
+    perror(file);
+  return fd;
+}
+
+// Point 'target' (stdin or stdout) at 'fd' for a builtin, keeping the old
+// target in *saved. *saved is -1 if the target was closed (F_DUPFD fails with
+// EBADF), which restore_builtin_fd() puts back by closing it again. 'fd' is
+// closed either way, unless it already is the target: the target was closed
+// and open() reused it, so there is nothing to move or keep. Returns -1, with
+// the target untouched, if the old one could not be kept.
+static int redirect_builtin_fd(int fd, int target, int *saved) {
+  if (fd == target) {
+    // As dup2() would, drop the O_CLOEXEC open_redirect() set
+    fcntl(target, F_SETFD, 0);
+    *saved = -1;
+    return 0;
+  }
+  // Above 2, and O_CLOEXEC so "exec cmd > file" doesn't pass it on
+  *saved = fcntl(target, F_DUPFD_CLOEXEC, 10);
+  if (*saved == -1 && errno != EBADF) {
+    perror("dup");
+    close(fd);
+    return -1;
+  }
+  dup2(fd, target);
+  close(fd);
   return 0;
 }
 
-int execute_command(struct Command *cmd) {
-  int pipes[cmd->num_pipes][2];
-  for (int i = 0; i < cmd->num_pipes; i++) {
-    if (pipe(pipes[i]) == -1) {
-      perror("Pipe");
-      return -1;
-    }
+// Only for a target redirect_builtin_fd() succeeded on: saved == -1 means it
+// was closed before, not that there is nothing to restore
+static void restore_builtin_fd(int target, int saved) {
+  if (saved == -1) {
+    close(target);
+    return;
+  }
+  dup2(saved, target);
+  close(saved);
+}
+
+// Run a lone builtin in the shell process. Its "<"/">" are dup2'd over
+// stdin/stdout for the call and put back afterwards, so "echo hi > f" costs
+// a few syscalls instead of a fork and an exec. Returns its exit status.
+static int run_builtin(const struct builtin *builtin, struct Stage *stage) {
+  int in_fd = -1, out_fd = -1;
+  int saved_in = -1, saved_out = -1;
+  bool in_redirected = false, out_redirected = false;
+  int status = 1;
+
+  if (stage->in_file != NULL &&
+      (in_fd = open_redirect(stage->in_file, O_RDONLY)) == -1)
+    return 1;
+  if (stage->out_file != NULL &&
+      (out_fd = open_redirect(stage->out_file,
+                              O_WRONLY | O_CREAT | O_TRUNC)) == -1) {
+    if (in_fd != -1)
+      close(in_fd);
+    return 1;
   }
-  for (int i = 0; i < cmd->pipe_cmd_count; i++) {
-    pid_t pid = fork();
-    if (pid == -1) {
-      perror("fork");
-      return -1;
+
+  // Output still buffered for the old stdout must go there
+  fflush(stdout);
+  if (in_fd != -1) {
+    if (redirect_builtin_fd(in_fd, STDIN_FILENO, &saved_in) == -1) {
+      if (out_fd != -1)
+        close(out_fd);
+      goto out;
     }
+    in_redirected = true;
+  }
+  if (out_fd != -1) {
+    if (redirect_builtin_fd(out_fd, STDOUT_FILENO, &saved_out) == -1)
+      goto out;
+    out_redirected = true;
+  }
 
-    if (pid == 0) {
-      // child process
+  status = builtin->func(stage->argv);
+  if (fflush(stdout) == EOF) {
+    fprintf(stderr, "%s: write error: %s\n", stage->argv[0], strerror(errno));
+    clearerr(stdout);
+    status = 1;
+  }
 
-      // Only first command can have a input redirect "<"
-      if (i == 0 && cmd->redirect_in) {
-        int fd = open(cmd->redirect_in_file, O_RDONLY);
-        if (fd == -1) {
-          perror("open");
-          exit(EXIT_FAILURE);
-        }
-        dup2(fd, STDIN_FILENO);
-        close(fd);
-      } else if (i > 0) {
-        dup2(pipes[i - 1][READ_END], STDIN_FILENO);
-      }
+out:
+  if (out_redirected)
+    restore_builtin_fd(STDOUT_FILENO, saved_out);
+  if (in_redirected)
+    restore_builtin_fd(STDIN_FILENO, saved_in);
+  return status;
+}
 
-      // Only last command can have a output redirect ">"
-      if (i == cmd->pipe_cmd_count - 1 && cmd->redirect_out) {
-        int fd =
-            open(cmd->redirect_out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-          perror("open");
-          exit(EXIT_FAILURE);
-        }
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-      } else if (i < cmd->pipe_cmd_count - 1) {
-        dup2(pipes[i][WRITE_END], STDOUT_FILENO);
-      }
+// Run the parsed pipeline as a job. Returns its exit status: the last
+// stage's exit code (128+N if it was killed by signal N, 127/126 if it could
+// not be started, 1 if its redirect could not be opened), or 0 for a
+// background pipeline. Every stage's status is kept for $PIPESTATUS.
+// A lone builtin in the foreground runs in the shell itself instead.
+int execute_command(struct Command *cmd) {
+  if (cmd->stage_count == 0)
+    return 0;
+
+  // Builtins change the shell's own state, so they can't be a pipeline
+  // stage or a background job; there the name is looked up in $PATH
+  // (unless it is one that forks, see spawn_stage())
+  const struct builtin *builtin;
+  if (cmd->stage_count == 1 && !cmd->run_background &&
+      (builtin = builtin_lookup(cmd->stages[0].argv[0])) != NULL &&
+      !builtin->forks) {
+    int status = run_builtin(builtin, &cmd->stages[0]);
+    jobs_set_status(status);
+    return status;
+  }
+
+  int num_pipes = cmd->stage_count - 1;
+  int pipes[num_pipes][2];
+  bool foreground = !cmd->run_background;
+  struct job *job = job_new(cmd->input_buf, cmd->stage_count, cmd->timed);
+  int status = 0;
 
-      // Close all pipes
-      for (int j = 0; j < cmd->num_pipes; j++) {
+  if (job == NULL) {
+    printf("Error: Out of memory\n");
+    jobs_set_status(1);
+    return 1;
+  }
+  for (int i = 0; i < num_pipes; i++) {
+    // O_CLOEXEC keeps every stage from inheriting the other stages' pipe
+    // ends, without a close() per fd per stage.
+    if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+      perror("Pipe");
+      for (int j = 0; j < i; j++) {
         close(pipes[j][READ_END]);
         close(pipes[j][WRITE_END]);
       }
+      job_discard(job);
+      jobs_set_status(1);
+      return 1;
+    }
+  }
+  // Don't let shell output still sitting in stdio end up after the stages'
+  fflush(stdout);
+  // Keep the SIGCHLD handler from reaping stages before they are in the job
+  // table
+  sigchld_block();
+  for (int i = 0; i < cmd->stage_count; i++) {
+    struct Stage *stage = &cmd->stages[i];
+    // A stage's own "<"/">" take precedence over the pipe
+    int in_fd = i == 0 ? -1 : pipes[i - 1][READ_END];
+    int out_fd = i == cmd->stage_count - 1 ? -1 : pipes[i][WRITE_END];
+    int in_file_fd = -1, out_file_fd = -1;
 
-      execvp(cmd->pipe_cmds[i][0], cmd->pipe_cmds[i]);
-      exit(1);
+    if (stage->in_file != NULL) {
+      in_file_fd = open_redirect(stage->in_file, O_RDONLY);
+      if (in_file_fd == -1) {
+        job_set_proc(job, i, stage->argv[0], -1, 1);
+        continue;
+      }
+      in_fd = in_file_fd;
     }
+    if (stage->out_file != NULL) {
+      out_file_fd = open_redirect(stage->out_file, O_WRONLY | O_CREAT | O_TRUNC);
+      if (out_file_fd == -1) {
+        if (in_file_fd != -1)
+          close(in_file_fd);
+        job_set_proc(job, i, stage->argv[0], -1, 1);
+        continue;
+      }
+      out_fd = out_file_fd;
+    }
+
+    // Every stage joins the group of the job's first started stage
+    pid_t pgid = job_control_enabled() ? job->pgid : -1;
+    pid_t pid = spawn_stage(stage->argv, in_fd, out_fd, pgid, foreground);
+    job_set_proc(job, i, stage->argv[0], pid,
+                 pid == -1 && errno == ENOENT ? 127 : 126);
+
+    if (in_file_fd != -1)
+      close(in_file_fd);
+    if (out_file_fd != -1)
+      close(out_file_fd);
   }
   // Close all pipes
-  for (int j = 0; j < cmd->num_pipes; j++) {
+  for (int j = 0; j < num_pipes; j++) {
     close(pipes[j][READ_END]);
     close(pipes[j][WRITE_END]);
   }
 
-  if (!cmd->run_background) {
-    for (int i = 0; i < cmd->pipe_cmd_count; i++)
-      wait(NULL);
+  if (job->live == 0) {
+    // Nothing was started
+    if (foreground) {
+      job_save_status(job);
+      status = jobs_last_status();
+    } else {
+      jobs_set_status(0);
+    }
+    job_discard(job);
+    sigchld_unblock();
+    return status;
   }
-  return 0;
+  job_register(job);
+  sigchld_unblock();
+
+  if (!foreground) {
+    job_background(job, false);
+    jobs_set_status(0);
+    return 0;
+  }
+  return job_foreground(job, false);
 }
 
 void reset_command(struct Command *cmd) {
-  cmd->args_length = 0;
-  cmd->args[0] = NULL;
-  cmd->redirect_in = false;
-  cmd->redirect_in_file = NULL;
-  cmd->redirect_out = false;
-  cmd->redirect_out_file = NULL;
+  // Drops input_buf and the stages in one go
+  arena_reset(&cmd->arena);
+  cmd->input_buf = NULL;
+  cmd->stages = NULL;
+  cmd->stage_count = 0;
   cmd->run_background = false;
-  cmd->pipe_cmd_count = 0;
-  cmd->num_pipes = 0;
-  memset(cmd->pipe_cmds, 0, sizeof(cmd->pipe_cmds));
-  memset(cmd->input_buf, 0, sizeof(cmd->input_buf));
+  cmd->timed = false;
+}
+
+void free_command(struct Command *cmd) {
+  arena_free(&cmd->arena);
+  free(cmd->last_command_buf);
+  cmd->last_command_buf = NULL;
 }
@@ -1,6 +1,7 @@
 #ifndef SHELL_H
 #define SHELL_H
 
+#include "arena.h"
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -9,35 +10,42 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#define MAXLINE 80
-#define BUFFER_LENGTH 1024
+// One command of a pipeline
+struct Stage {
+  char **argv; // NULL terminated
+  int argc;
+  char *in_file;  // "<" target, or NULL
+  char *out_file; // ">" target, or NULL
+};
 
 struct Command {
+  ////////// MEMORY //////////
+  struct arena arena; // owns input_buf and the stages for one line
   ////////// INPUT //////////
-  char input_buf[BUFFER_LENGTH];
-  char last_command_buf[BUFFER_LENGTH];
-  ////////// ARGS //////////
-  char *args[MAXLINE];
-  int args_length;
+  char *input_buf;
+  char *last_command_buf; // heap allocated, survives reset_command()
+  ////////// PIPELINE //////////
+  struct Stage *stages;
+  int stage_count;
   bool run_background;
-  ////////// REDIRECTS //////////
-  bool redirect_out;
-  char *redirect_out_file;
-  bool redirect_in;
-  char *redirect_in_file;
-  ////////// PIPE //////////
-  int num_pipes;
-  char **pipe_cmds[MAXLINE];
-  int pipe_cmd_count;
+  bool timed; // "time" prefix
+};
+
+// How execute_command() starts each pipeline stage.
+enum spawn_backend {
+  SPAWN_POSIX, // posix_spawn(), no address space copy (default)
+  SPAWN_FORK,  // fork() + execvp()
 };
 
 #ifdef DEBUG
 void debug_command(struct Command *cmd);
 #endif
 
-int tokenize_input(struct Command *cmd);
+int set_command_input(struct Command *cmd, const char *line);
 int parse_input(struct Command *cmd);
 int execute_command(struct Command *cmd);
 void reset_command(struct Command *cmd);
+void free_command(struct Command *cmd);
+void set_spawn_backend(enum spawn_backend backend);
 
 #endif // SHELL_H
@@ -0,0 +1,136 @@
+// Benchmark: cost per PID of querying tasks through the text interface
+// (/proc/pid, one write and one read per PID) against /proc/task_batch (one
+// write of every PID, then one pread() per poll of the whole set).
+//
+// Usage: task_batch_bench [-r rounds] [pid...]
+//
+// Without PIDs it queries every process listed in /proc.
+
+#include "task_info.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PID_PATH "/proc/pid"
+#define BATCH_PATH "/proc/task_batch"
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Every numeric entry of /proc
+static int list_pids(__s32 **pids) {
+  DIR *dir = opendir("/proc");
+  struct dirent *ent;
+  int n = 0, cap = 1024;
+
+  *pids = malloc(cap * sizeof(**pids));
+  if (dir == NULL || *pids == NULL) {
+    perror("/proc");
+    exit(1);
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    if (!isdigit((unsigned char)ent->d_name[0]))
+      continue;
+    if (n == cap) {
+      cap *= 2;
+      *pids = realloc(*pids, cap * sizeof(**pids));
+      if (*pids == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    (*pids)[n++] = atoi(ent->d_name);
+  }
+  closedir(dir);
+  return n;
+}
+
+// One write and one read per PID, like `echo N > /proc/pid; cat /proc/pid`
+// done through a single descriptor
+static double bench_text(int fd, const __s32 *pids, int n, int rounds) {
+  char buf[1024];
+  uint64_t start = now_ns();
+
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < n; i++) {
+      int len = snprintf(buf, sizeof(buf), "%d", pids[i]);
+      if (write(fd, buf, len) != len || pread(fd, buf, sizeof(buf), 0) < 0) {
+        perror(PID_PATH);
+        exit(1);
+      }
+    }
+  }
+  return (double)(now_ns() - start) / ((double)rounds * n);
+}
+
+// The PIDs are written once; every round is one pread() of all records
+static double bench_batch(int fd, const __s32 *pids, int n, int rounds) {
+  size_t size = n * sizeof(struct task_info_record);
+  struct task_info_record *recs = malloc(size);
+  uint64_t start = now_ns();
+
+  if (recs == NULL || write(fd, pids, n * sizeof(*pids)) < 0) {
+    perror(BATCH_PATH);
+    exit(1);
+  }
+  for (int r = 0; r < rounds; r++) {
+    if (pread(fd, recs, size, 0) != (ssize_t)size) {
+      perror(BATCH_PATH);
+      exit(1);
+    }
+  }
+  free(recs);
+  return (double)(now_ns() - start) / ((double)rounds * n);
+}
+
+int main(int argc, char *argv[]) {
+  int rounds = 100, opt;
+  __s32 *pids;
+  int n;
+
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    if (opt != 'r') {
+      fprintf(stderr, "Usage: %s [-r rounds] [pid...]\n", argv[0]);
+      return 2;
+    }
+    rounds = atoi(optarg);
+  }
+  if (optind < argc) {
+    n = argc - optind;
+    pids = malloc(n * sizeof(*pids));
+    if (pids == NULL) {
+      perror("malloc");
+      return 1;
+    }
+    for (int i = 0; i < n; i++)
+      pids[i] = atoi(argv[optind + i]);
+  } else {
+    n = list_pids(&pids);
+  }
+
+  int text_fd = open(PID_PATH, O_RDWR);
+  int batch_fd = open(BATCH_PATH, O_RDWR);
+  if (text_fd == -1 || batch_fd == -1) {
+    perror("open");
+    return 1;
+  }
+
+  printf("%d pids, %d rounds\n", n, rounds);
+  printf("text  (/proc/pid)        %8.0f ns per pid\n",
+         bench_text(text_fd, pids, n, rounds));
+  printf("batch (/proc/task_batch) %8.0f ns per pid\n",
+         bench_batch(batch_fd, pids, n, rounds));
+
+  close(text_fd);
+  close(batch_fd);
+  free(pids);
+  return 0;
+}
@@ -1,9 +1,30 @@
+#include "linux/atomic.h"
 #include "linux/fs.h"
+#include "linux/hrtimer.h"
+#include "linux/idr.h"
+#include "linux/ktime.h"
+#include "linux/log2.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/mm.h"
+#include "linux/mutex.h"
+#include "linux/overflow.h"
 #include "linux/pid.h"
+#include "linux/pid_namespace.h"
+#include "linux/rcupdate.h"
 #include "linux/sched.h"
+#include "linux/sched/signal.h"
+#include "linux/sched/task.h"
+#include "linux/seq_file.h"
 #include "linux/slab.h"
+#include "linux/spinlock.h"
+#include "linux/string.h"
 #include "linux/types.h"
 #include "linux/uaccess.h"
+#include "linux/version.h"
+#include "linux/vmalloc.h"
+#include "linux/workqueue.h"
+#include "task_info.h"
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -11,58 +32,233 @@
 
 #define BUFFER_SIZE 1024
 #define PROC_NAME "pid"
+#define TASKS_NAME "tasks"
+#define BATCH_NAME "task_batch"
+#define BATCH_MAX 65536 // PIDs per write to /proc/task_batch
+#define BATCH_CHUNK 64  // records filled per rcu_read_lock() section
+#define RING_NAME "task_ring"
+// Limits per open /proc/task_ring, which only root may open: the ring is
+// at most 4 MB of unswappable memory, and a ring takes at most a million
+// samples a second between its period and its PIDs
+#define RING_MAX_RECORDS (1 << 16)
+#define RING_MIN_PERIOD_US 100
+#define RING_MAX_RATE 1000000 // samples per second
 
+static int proc_open(struct inode *inode, struct file *file);
+static int proc_release(struct inode *inode, struct file *file);
 ssize_t proc_read(struct file *file, char __user *usr_buf, size_t count,
                   loff_t *pos);
 ssize_t proc_write(struct file *file, const char __user *usr_buf, size_t count,
                    loff_t *pos);
 
-static struct proc_ops proc_ops = {.proc_read = proc_read,
+ssize_t tasks_write(struct file *file, const char __user *usr_buf,
+                    size_t count, loff_t *pos);
+static int tasks_open(struct inode *inode, struct file *file);
+static int batch_open(struct inode *inode, struct file *file);
+static int batch_release(struct inode *inode, struct file *file);
+ssize_t batch_read(struct file *file, char __user *usr_buf, size_t count,
+                   loff_t *pos);
+ssize_t batch_write(struct file *file, const char __user *usr_buf,
+                    size_t count, loff_t *pos);
+static int ring_open(struct inode *inode, struct file *file);
+static int ring_release(struct inode *inode, struct file *file);
+ssize_t ring_write(struct file *file, const char __user *usr_buf,
+                   size_t count, loff_t *pos);
+static int ring_mmap(struct file *file, struct vm_area_struct *vma);
+
+static struct proc_ops proc_ops = {.proc_open = proc_open,
+                                   .proc_release = proc_release,
+                                   .proc_read = proc_read,
                                    .proc_write = proc_write};
 
-static long pid = -1;
+static struct proc_ops tasks_ops = {.proc_open = tasks_open,
+                                    .proc_read = seq_read,
+                                    .proc_lseek = seq_lseek,
+                                    .proc_release = seq_release_private,
+                                    .proc_write = tasks_write};
+
+static struct proc_ops batch_ops = {.proc_open = batch_open,
+                                    .proc_release = batch_release,
+                                    .proc_read = batch_read,
+                                    .proc_write = batch_write};
+
+static struct proc_ops ring_ops = {.proc_open = ring_open,
+                                   .proc_release = ring_release,
+                                   .proc_write = ring_write,
+                                   .proc_mmap = ring_mmap};
+
+/*
+ * Every open file keeps its own query in file->private_data (for
+ * /proc/tasks, in the seq_file's private data), so any number of pollers
+ * can use the module at once without seeing each other's PIDs.
+ *
+ * The PID and filter last written through any file are also kept here, and
+ * a new open starts from them. That keeps `echo 1 > /proc/pid` followed by
+ * `cat /proc/pid`, two different opens, working.
+ */
+static atomic_long_t last_pid = ATOMIC_LONG_INIT(-1);
+static DEFINE_SPINLOCK(last_filter_lock);
+static char last_filter[TASK_COMM_LEN];
+
+// The PIDs written to one open /proc/task_batch. 'lock' is only contended
+// by threads sharing the file.
+struct task_batch {
+  struct mutex lock;
+  __s32 *pids;
+  size_t count;
+};
+
+// One open /proc/task_ring: the ring mapped by the reader and what fills it.
+// head, nr_records, dropped and missed are the module's own copies; the
+// reader can write anything into the header, so it is never read back
+// (except tail, which is only compared).
+struct task_ring {
+  struct mutex lock; // configuring vs. mmap()
+  void *mem;         // vmalloc_user(): the header, then the records
+  struct task_ring_header *header;
+  struct task_ring_record *records;
+  u32 nr_records;
+  u64 head;
+  u64 dropped;
+  u64 missed;
+  __s32 *pids;
+  u32 nr_pids;
+  // The writer's PID namespace: the sweeps run in a kworker, whose own
+  // namespace is the initial one
+  struct pid_namespace *ns;
+  ktime_t period;
+  struct hrtimer timer;
+  struct work_struct work;
+};
 
 static int proc_init(void) {
-  proc_create(PROC_NAME, 0666, NULL, &proc_ops);
+  if (!proc_create(PROC_NAME, 0666, NULL, &proc_ops))
+    return -ENOMEM;
+  if (!proc_create(TASKS_NAME, 0666, NULL, &tasks_ops))
+    goto remove_pid;
+  if (!proc_create(BATCH_NAME, 0666, NULL, &batch_ops))
+    goto remove_tasks;
+  if (!proc_create(RING_NAME, 0600, NULL, &ring_ops))
+    goto remove_batch;
+
+  return 0;
+
+remove_batch:
+  remove_proc_entry(BATCH_NAME, NULL);
+remove_tasks:
+  remove_proc_entry(TASKS_NAME, NULL);
+remove_pid:
+  remove_proc_entry(PROC_NAME, NULL);
+  return -ENOMEM;
+}
+
+static void proc_exit(void) {
+  remove_proc_entry(RING_NAME, NULL);
+  remove_proc_entry(BATCH_NAME, NULL);
+  remove_proc_entry(TASKS_NAME, NULL);
+  remove_proc_entry(PROC_NAME, NULL);
+}
+
+// What /proc/pid reports about a task, copied out under RCU so it can be
+// formatted after the task may have exited
+struct task_snapshot {
+  char comm[TASK_COMM_LEN];
+  pid_t pid;
+  unsigned int state;
+  unsigned int cpu; // CPU it last ran on
+  int prio;
+  unsigned int policy;
+  u64 sum_exec_runtime; // ns on the CPU
+  unsigned long nvcsw, nivcsw;
+  unsigned long min_flt, maj_flt;
+};
+
+// Copy what we report about PID 'nr' into 'snap'. Returns false if there is
+// no such task. The task_struct may be freed as soon as the task is reaped;
+// rcu_read_lock() keeps it valid until we are done with it.
+static bool snapshot_task(pid_t nr, struct task_snapshot *snap) {
+  struct task_struct *task;
 
+  rcu_read_lock();
+  task = pid_task(find_vpid(nr), PIDTYPE_PID);
+  if (!task) {
+    rcu_read_unlock();
+    return false;
+  }
+  strscpy_pad(snap->comm, task->comm, sizeof(snap->comm));
+  snap->pid = task->pid;
+  snap->state = READ_ONCE(task->__state);
+  snap->cpu = task_cpu(task);
+  snap->prio = task->prio;
+  snap->policy = task->policy;
+  snap->sum_exec_runtime = task->se.sum_exec_runtime;
+  snap->nvcsw = task->nvcsw;
+  snap->nivcsw = task->nivcsw;
+  snap->min_flt = task->min_flt;
+  snap->maj_flt = task->maj_flt;
+  rcu_read_unlock();
+  return true;
+}
+
+// The PID queried through this file, -1 for none
+static int proc_open(struct inode *inode, struct file *file) {
+  long *pid = kmalloc(sizeof(*pid), GFP_KERNEL);
+
+  if (!pid)
+    return -ENOMEM;
+  *pid = atomic_long_read(&last_pid);
+  file->private_data = pid;
   return 0;
 }
 
-static void proc_exit(void) { remove_proc_entry(PROC_NAME, NULL); }
+static int proc_release(struct inode *inode, struct file *file) {
+  kfree(file->private_data);
+  return 0;
+}
 
 ssize_t proc_read(struct file *file, char __user *usr_buf, size_t count,
                   loff_t *offset) {
+  long pid = READ_ONCE(*(long *)file->private_data);
   char buffer[BUFFER_SIZE];
+  struct task_snapshot snap;
   int bytes_written;
 
   // Write data to buffer
   if (pid == -1) {
     bytes_written = snprintf(buffer, BUFFER_SIZE, "No PID\n");
+  } else if (!snapshot_task(pid, &snap)) {
+    bytes_written =
+        snprintf(buffer, BUFFER_SIZE, "No such process: %ld\n", pid);
   } else {
-    struct pid *pid_st = find_vpid(pid);
-    struct task_struct *task = pid_task(pid_st, PIDTYPE_PID);
     bytes_written = snprintf(buffer, BUFFER_SIZE,
                              "command = [%s]\n"
                              "pid = [%d]\n"
-                             "state = [%d]\n",
-                             task->comm, task->pid, task->__state);
+                             "state = [%u]\n"
+                             "cpu = [%u]\n"
+                             "prio = [%d]\n"
+                             "policy = [%u]\n"
+                             "runtime_ns = [%llu]\n"
+                             "voluntary_switches = [%lu]\n"
+                             "involuntary_switches = [%lu]\n"
+                             "minor_faults = [%lu]\n"
+                             "major_faults = [%lu]\n",
+                             snap.comm, snap.pid, snap.state, snap.cpu,
+                             snap.prio, snap.policy,
+                             (unsigned long long)snap.sum_exec_runtime,
+                             snap.nvcsw, snap.nivcsw, snap.min_flt,
+                             snap.maj_flt);
   }
 
-  int ret = bytes_written;
-  if (*offset >= bytes_written ||
-      copy_to_user(usr_buf, buffer, bytes_written)) {
-    pr_info("copy_to_user failed");
-    ret = 0;
-  } else {
-    pr_info("procfile read: %s\n", file->f_path.dentry->d_name.name);
-    *offset += bytes_written;
-  }
-  return ret;
+  pr_debug("procfile read: %s\n", file->f_path.dentry->d_name.name);
+  // Copies at most 'count' bytes from *offset on and advances it
+  return simple_read_from_buffer(usr_buf, count, offset, buffer,
+                                 bytes_written);
 }
 
 ssize_t proc_write(struct file *file, const char __user *usr_buf, size_t count,
                    loff_t *pos) {
   char *k_mem;
+  long pid;
 
   k_mem = kmalloc(count + 1, GFP_KERNEL);
   if (!k_mem) {
@@ -73,19 +269,409 @@ ssize_t proc_write(struct file *file, const char __user *usr_buf, size_t count,
     kfree(k_mem);
     return -EFAULT;
   }
-  pr_info("Received %zu bytes from user space\n", count);
-  pr_info("Received this string: %s\n", k_mem);
+  k_mem[count] = '\0';
+  pr_debug("Received %zu bytes from user space\n", count);
+  pr_debug("Received this string: %s\n", k_mem);
 
   if (kstrtol(k_mem, 10, &pid) < 0) {
     kfree(k_mem);
     return -EINVAL;
   }
-  pr_info("PID: %ld\n", pid);
+  pr_debug("PID: %ld\n", pid);
+  WRITE_ONCE(*(long *)file->private_data, pid);
+  atomic_long_set(&last_pid, pid);
 
   kfree(k_mem);
   return count;
 }
 
+/*
+ * /proc/tasks: every task (thread) on the system, one line each. The output
+ * is made by the seq_file iterator a page at a time as it is read, instead
+ * of in one fixed buffer, so any number of tasks can be listed. The position
+ * in the file is the PID number to continue from: each read looks up the
+ * next PID in the PID namespace's IDR, the way /proc itself lists PIDs, so
+ * it costs nothing to resume and tasks that exit in between are skipped.
+ */
+
+// Return the first task with a PID >= *pos whose command contains 'filter'
+// (any task if it is empty) and set *pos to its PID, or NULL if there are no
+// more. Called under rcu_read_lock().
+static struct task_struct *next_task(loff_t *pos, const char *filter) {
+  struct pid_namespace *ns = task_active_pid_ns(current);
+  struct pid *pid_st;
+  int nr;
+
+  if (*pos > INT_MAX)
+    return NULL;
+  nr = *pos;
+  while ((pid_st = idr_get_next(&ns->idr, &nr)) != NULL) {
+    struct task_struct *task = pid_task(pid_st, PIDTYPE_PID);
+
+    if (task && (!filter[0] || strstr(task->comm, filter))) {
+      *pos = nr;
+      return task;
+    }
+    nr++;
+  }
+  *pos = (loff_t)INT_MAX + 1;
+  return NULL;
+}
+
+static void *tasks_start(struct seq_file *m, loff_t *pos) __acquires(RCU) {
+  rcu_read_lock();
+  // Position 0 is the header; PIDs start at 1
+  if (*pos == 0)
+    return SEQ_START_TOKEN;
+  return next_task(pos, m->private);
+}
+
+static void *tasks_next(struct seq_file *m, void *v, loff_t *pos) {
+  ++*pos;
+  return next_task(pos, m->private);
+}
+
+static void tasks_stop(struct seq_file *m, void *v) __releases(RCU) {
+  rcu_read_unlock();
+}
+
+static int tasks_show(struct seq_file *m, void *v) {
+  struct task_struct *task = v;
+
+  if (v == SEQ_START_TOKEN) {
+    seq_puts(m, "    PID STATE COMMAND\n");
+    return 0;
+  }
+  seq_printf(m, "%7d %5u %s\n", task_pid_vnr(task), READ_ONCE(task->__state),
+             task->comm);
+  return 0;
+}
+
+static const struct seq_operations tasks_seq_ops = {.start = tasks_start,
+                                                    .next = tasks_next,
+                                                    .stop = tasks_stop,
+                                                    .show = tasks_show};
+
+// The seq_file's private data is this file's filter
+static int tasks_open(struct inode *inode, struct file *file) {
+  char *filter = __seq_open_private(file, &tasks_seq_ops, TASK_COMM_LEN);
+
+  if (!filter)
+    return -ENOMEM;
+  spin_lock(&last_filter_lock);
+  strscpy(filter, last_filter, TASK_COMM_LEN);
+  spin_unlock(&last_filter_lock);
+  return 0;
+}
+
+// Set the filter: a command name, or an empty line to list every task
+ssize_t tasks_write(struct file *file, const char __user *usr_buf,
+                    size_t count, loff_t *pos) {
+  struct seq_file *m = file->private_data;
+  char buffer[TASK_COMM_LEN + 1];
+
+  if (count > TASK_COMM_LEN)
+    return -EINVAL;
+  if (copy_from_user(buffer, usr_buf, count))
+    return -EFAULT;
+  buffer[count] = '\0';
+  buffer[strcspn(buffer, "\n")] = '\0';
+  if (strlen(buffer) >= TASK_COMM_LEN)
+    return -EINVAL;
+
+  // m->lock keeps a read through the same file from seeing half of it
+  mutex_lock(&m->lock);
+  strscpy(m->private, buffer, TASK_COMM_LEN);
+  mutex_unlock(&m->lock);
+  spin_lock(&last_filter_lock);
+  strscpy(last_filter, buffer, sizeof(last_filter));
+  spin_unlock(&last_filter_lock);
+  pr_debug("tasks filter: \"%s\"\n", buffer);
+  return count;
+}
+
+/*
+ * /proc/task_batch: one write() submits any number of PIDs as a packed
+ * __s32 array, and read() returns a fixed-size struct task_info_record for
+ * each (see task_info.h). A poller pays two syscalls per batch instead of
+ * two per PID, and no number is parsed or printed on either side.
+ */
+
+// Fill 'rec' for PID 'nr' as seen in 'ns'. Called under rcu_read_lock(),
+// which keeps the task_struct from being freed even if the task exits
+// meanwhile.
+static void fill_record(struct task_info_record *rec, pid_t nr,
+                        struct pid_namespace *ns) {
+  struct task_struct *task = pid_task(find_pid_ns(nr, ns), PIDTYPE_PID);
+
+  memset(rec, 0, sizeof(*rec));
+  rec->pid = nr;
+  if (!task) {
+    rec->state = -1;
+    return;
+  }
+  rec->state = READ_ONCE(task->__state);
+  rec->utime = task->utime;
+  rec->stime = task->stime;
+  rec->nr_threads = get_nr_threads(task);
+  strscpy_pad(rec->comm, task->comm, sizeof(rec->comm));
+  // task_lock() keeps exit_mm() from dropping the mm while we read it
+  task_lock(task);
+  if (task->mm)
+    rec->rss = get_mm_rss(task->mm);
+  task_unlock(task);
+}
+
+static int batch_open(struct inode *inode, struct file *file) {
+  struct task_batch *batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+
+  if (!batch)
+    return -ENOMEM;
+  mutex_init(&batch->lock);
+  file->private_data = batch;
+  return 0;
+}
+
+static int batch_release(struct inode *inode, struct file *file) {
+  struct task_batch *batch = file->private_data;
+
+  kvfree(batch->pids);
+  kfree(batch);
+  return 0;
+}
+
+// Return records for the PIDs from the file position on. Only whole records
+// are returned.
+ssize_t batch_read(struct file *file, char __user *usr_buf, size_t count,
+                   loff_t *pos) {
+  const size_t size = sizeof(struct task_info_record);
+  struct task_batch *batch = file->private_data;
+  struct pid_namespace *ns = task_active_pid_ns(current);
+  struct task_info_record *records;
+  size_t next, n, i;
+  ssize_t ret = 0;
+  u32 rem;
+
+  if (count < size || *pos < 0)
+    return -EINVAL;
+  next = div_u64_rem(*pos, size, &rem);
+  if (rem)
+    return -EINVAL;
+  records = kmalloc_array(BATCH_CHUNK, size, GFP_KERNEL);
+  if (!records)
+    return -ENOMEM;
+
+  mutex_lock(&batch->lock);
+  while (next < batch->count && count - ret >= size) {
+    n = min3((size_t)BATCH_CHUNK, batch->count - next, (count - ret) / size);
+    rcu_read_lock();
+    for (i = 0; i < n; i++)
+      fill_record(&records[i], batch->pids[next + i], ns);
+    rcu_read_unlock();
+
+    if (copy_to_user(usr_buf + ret, records, n * size)) {
+      if (ret == 0)
+        ret = -EFAULT;
+      break;
+    }
+    ret += n * size;
+    next += n;
+  }
+  mutex_unlock(&batch->lock);
+
+  kfree(records);
+  if (ret > 0)
+    *pos += ret;
+  return ret;
+}
+
+// Replace the PID list and rewind, so the next read answers it
+ssize_t batch_write(struct file *file, const char __user *usr_buf,
+                    size_t count, loff_t *pos) {
+  struct task_batch *batch = file->private_data;
+  __s32 *pids;
+
+  if (count == 0 || count % sizeof(*pids) ||
+      count > BATCH_MAX * sizeof(*pids))
+    return -EINVAL;
+  pids = vmemdup_user(usr_buf, count);
+  if (IS_ERR(pids))
+    return PTR_ERR(pids);
+
+  mutex_lock(&batch->lock);
+  kvfree(batch->pids);
+  batch->pids = pids;
+  batch->count = count / sizeof(*pids);
+  mutex_unlock(&batch->lock);
+
+  *pos = 0;
+  return count;
+}
+
+/*
+ * /proc/task_ring: a ring buffer of task samples shared with the reader
+ * through mmap(). After the configuration is written, an hrtimer fires
+ * every period and queues a work item that takes one sample of every
+ * watched PID (a sweep). The sampling runs from a workqueue rather than the
+ * timer itself because fill_record() takes task_lock(), which may not be
+ * taken in interrupt context. The reader consumes the samples straight from
+ * its mapping, with no syscall per sample or per sweep; see task_info.h for
+ * the protocol.
+ */
+
+// Take one sweep into the ring
+static void ring_sample(struct work_struct *work) {
+  struct task_ring *ring = container_of(work, struct task_ring, work);
+  struct task_ring_header *header = ring->header;
+  u64 now = ktime_get_ns();
+  u64 tail = smp_load_acquire(&header->tail);
+  u32 i;
+
+  for (i = 0; i < ring->nr_pids; i++) {
+    struct task_ring_record *rec;
+
+    if (ring->head - tail >= ring->nr_records) {
+      // The reader may have made room since we looked
+      tail = smp_load_acquire(&header->tail);
+      if (ring->head - tail >= ring->nr_records) {
+        ring->dropped += ring->nr_pids - i;
+        WRITE_ONCE(header->dropped, ring->dropped);
+        break;
+      }
+    }
+    rec = &ring->records[ring->head & (ring->nr_records - 1)];
+    rec->time = now;
+    rcu_read_lock();
+    fill_record(&rec->task, ring->pids[i], ring->ns);
+    rcu_read_unlock();
+    ring->head++;
+  }
+  // Publishes the records written above along with the new head
+  smp_store_release(&header->head, ring->head);
+}
+
+static enum hrtimer_restart ring_tick(struct hrtimer *timer) {
+  struct task_ring *ring = container_of(timer, struct task_ring, timer);
+  u64 overruns = hrtimer_forward_now(timer, ring->period);
+
+  // A sweep that is still queued or the timer firing late both lose periods
+  if (!queue_work(system_highpri_wq, &ring->work))
+    overruns++;
+  if (overruns > 1) {
+    ring->missed += overruns - 1;
+    WRITE_ONCE(ring->header->missed, ring->missed);
+  }
+  return HRTIMER_RESTART;
+}
+
+static int ring_open(struct inode *inode, struct file *file) {
+  struct task_ring *ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+
+  if (!ring)
+    return -ENOMEM;
+  mutex_init(&ring->lock);
+  INIT_WORK(&ring->work, ring_sample);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+  hrtimer_setup(&ring->timer, ring_tick, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+  hrtimer_init(&ring->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  ring->timer.function = ring_tick;
+#endif
+  file->private_data = ring;
+  return 0;
+}
+
+// Called once the file is closed and unmapped, so nobody reads the ring
+static int ring_release(struct inode *inode, struct file *file) {
+  struct task_ring *ring = file->private_data;
+
+  // The timer first, so it can't queue the work again
+  hrtimer_cancel(&ring->timer);
+  cancel_work_sync(&ring->work);
+  vfree(ring->mem);
+  kvfree(ring->pids);
+  if (ring->ns)
+    put_pid_ns(ring->ns);
+  kfree(ring);
+  return 0;
+}
+
+// Take the configuration, allocate the ring and start sampling. Each open
+// file can be configured once.
+ssize_t ring_write(struct file *file, const char __user *usr_buf,
+                   size_t count, loff_t *pos) {
+  struct task_ring *ring = file->private_data;
+  struct task_ring_config config;
+  size_t data_offset, size;
+  __s32 *pids;
+  ssize_t ret = count;
+
+  if (count < sizeof(config))
+    return -EINVAL;
+  if (copy_from_user(&config, usr_buf, sizeof(config)))
+    return -EFAULT;
+  if (config.period_us < RING_MIN_PERIOD_US ||
+      !is_power_of_2(config.nr_records) ||
+      config.nr_records > RING_MAX_RECORDS || config.nr_pids == 0 ||
+      config.nr_pids > BATCH_MAX ||
+      (u64)config.nr_pids * USEC_PER_SEC >
+          (u64)RING_MAX_RATE * config.period_us ||
+      count != struct_size(&config, pids, config.nr_pids))
+    return -EINVAL;
+  pids = vmemdup_user(usr_buf + sizeof(config),
+                      config.nr_pids * sizeof(*pids));
+  if (IS_ERR(pids))
+    return PTR_ERR(pids);
+
+  data_offset = PAGE_ALIGN(sizeof(struct task_ring_header));
+  size = PAGE_ALIGN(data_offset +
+                    config.nr_records * sizeof(struct task_ring_record));
+
+  mutex_lock(&ring->lock);
+  if (ring->mem) {
+    ret = -EBUSY;
+    goto out;
+  }
+  // Zeroed, and allowed to be mapped to user space
+  ring->mem = vmalloc_user(size);
+  if (!ring->mem) {
+    ret = -ENOMEM;
+    goto out;
+  }
+  ring->header = ring->mem;
+  ring->records = ring->mem + data_offset;
+  ring->nr_records = config.nr_records;
+  ring->pids = pids;
+  ring->nr_pids = config.nr_pids;
+  ring->ns = get_pid_ns(task_active_pid_ns(current));
+  ring->period = us_to_ktime(config.period_us);
+  pids = NULL;
+
+  ring->header->nr_records = config.nr_records;
+  ring->header->record_size = sizeof(struct task_ring_record);
+  ring->header->data_offset = data_offset;
+  ring->header->period_us = config.period_us;
+  hrtimer_start(&ring->timer, ring->period, HRTIMER_MODE_REL);
+
+out:
+  mutex_unlock(&ring->lock);
+  kvfree(pids);
+  return ret;
+}
+
+// Map the header and the records, from offset 0
+static int ring_mmap(struct file *file, struct vm_area_struct *vma) {
+  struct task_ring *ring = file->private_data;
+  int ret = -EINVAL;
+
+  mutex_lock(&ring->lock);
+  // remap_vmalloc_range() refuses mappings larger than the ring
+  if (ring->mem && vma->vm_pgoff == 0)
+    ret = remap_vmalloc_range(vma, ring->mem, 0);
+  mutex_unlock(&ring->lock);
+  return ret;
+}
+
 module_init(proc_init);
 module_exit(proc_exit);
 
@@ -0,0 +1,65 @@
+#ifndef TASK_INFO_H
+#define TASK_INFO_H
+
+#include <linux/types.h>
+
+// Binary interfaces of the module, shared with user space.
+
+// /proc/task_batch: write an array of __s32 PIDs to the file, then read:
+// every PID comes back as one struct task_info_record, in the order written.
+// pread() at offset 0 repeats the query without writing the PIDs again.
+
+#define TASK_INFO_COMM_LEN 16
+
+struct task_info_record {
+  __s32 pid;
+  __s32 state;      // task->__state, or -1 if there is no such task
+  __u64 utime;      // user CPU time in ns
+  __u64 stime;      // system CPU time in ns
+  __u64 rss;        // resident set size in pages
+  __s32 nr_threads; // threads in the task's thread group
+  __u32 reserved;
+  char comm[TASK_INFO_COMM_LEN];
+};
+
+// /proc/task_ring: write a struct task_ring_config (followed by its PIDs) to
+// the file, then mmap() it. The module samples those PIDs every period_us
+// into a ring in the mapping, and the reader takes the samples out with no
+// syscalls. The mapping starts with a struct task_ring_header; the records
+// follow at data_offset.
+//
+// The module only ever writes 'head' and the reader only 'tail', each on
+// its own cache line. Record i is at index i % nr_records and is ready once
+// head > i: load head with acquire ordering, read the records up to it, then
+// store the new tail with release ordering so the module may reuse their
+// slots. When the ring is full the module drops samples rather than
+// overwrite unread ones.
+
+struct task_ring_config {
+  __u32 period_us;  // sampling period
+  __u32 nr_records; // ring size, a power of two
+  __u32 nr_pids;
+  __u32 reserved;
+  __s32 pids[];
+};
+
+struct task_ring_header {
+  __u64 head; // records written by the module
+  __u64 pad1[7];
+  __u64 tail; // records consumed by the reader
+  __u64 pad2[7];
+  __u32 nr_records;
+  __u32 record_size;
+  __u32 data_offset; // of the first record, from the start of the mapping
+  __u32 period_us;
+  __u64 dropped; // samples lost because the ring was full
+  __u64 missed;  // periods skipped because the last sweep was still running
+};
+
+// One sample of one task
+struct task_ring_record {
+  __u64 time; // CLOCK_MONOTONIC ns of the sweep it was taken in
+  struct task_info_record task;
+};
+
+#endif // TASK_INFO_H
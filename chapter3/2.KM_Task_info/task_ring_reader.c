@@ -0,0 +1,231 @@
+// Reader for /proc/task_ring: samples the given PIDs through the module's
+// shared ring buffer for a while, then reports how many samples arrived and
+// how many were lost.
+//
+// Usage: task_ring_reader [-p period_us] [-n records] [-t seconds] [-v] [-s]
+//                         pid...
+//
+// With -s it sweeps: it samples for 'seconds' at period_us, then at half
+// that, and so on down to the shortest period the module allows (100 us, or
+// one us per PID), printing the loss at each period, to find the rate at
+// which the reader or the module starts to fall behind.
+//
+// The ring is read by polling the mapping, so no syscall is made per sample
+// (the clock is read through the vDSO); this keeps one CPU busy while it
+// runs.
+
+#include "task_info.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_PATH "/proc/task_ring"
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-p period_us] [-n records] [-t seconds] [-v] [-s] "
+          "pid...\n",
+          name);
+  exit(2);
+}
+
+struct result {
+  double elapsed;
+  uint64_t received, sweeps, dropped, missed, lost;
+  unsigned int nr_records;
+};
+
+// Sample the PIDs every period_us for 'seconds' through a ring of its own
+static int sample(unsigned int period_us, unsigned int nr_records,
+                  const __s32 *pids, int nr_pids, double seconds, int verbose,
+                  struct result *res) {
+  // Configure: the PIDs follow the fixed part
+  size_t len = sizeof(struct task_ring_config) + nr_pids * sizeof(__s32);
+  struct task_ring_config *config = calloc(1, len);
+  if (config == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  config->period_us = period_us;
+  config->nr_records = nr_records;
+  config->nr_pids = nr_pids;
+  memcpy(config->pids, pids, nr_pids * sizeof(__s32));
+
+  // Each open file is configured once, so every run opens its own
+  int fd = open(RING_PATH, O_RDWR);
+  if (fd == -1) {
+    perror(RING_PATH);
+    free(config);
+    return -1;
+  }
+  ssize_t written = write(fd, config, len);
+  free(config);
+  if (written != (ssize_t)len) {
+    perror("write config");
+    close(fd);
+    return -1;
+  }
+
+  // Map the header first to learn where the records are
+  long page = sysconf(_SC_PAGESIZE);
+  struct task_ring_header *header =
+      mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+  size_t size = header->data_offset +
+                (size_t)header->nr_records * header->record_size;
+  munmap(header, page);
+  header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+  struct task_ring_record *records =
+      (struct task_ring_record *)((char *)header + header->data_offset);
+  uint64_t mask = header->nr_records - 1;
+
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)(seconds * 1e9);
+  uint64_t tail = 0, received = 0, sweeps = 0, last_time = 0;
+
+  while (now_ns() < end) {
+    // Acquire: the records up to head are written before head is
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (head == tail)
+      continue;
+    for (; tail != head; tail++) {
+      struct task_ring_record *rec = &records[tail & mask];
+      if (rec->time != last_time) {
+        sweeps++;
+        last_time = rec->time;
+      }
+      if (verbose)
+        printf("%llu.%09llu %d %s state %d rss %llu\n",
+               (unsigned long long)rec->time / 1000000000,
+               (unsigned long long)rec->time % 1000000000, rec->task.pid,
+               rec->task.comm, rec->task.state,
+               (unsigned long long)rec->task.rss);
+      received++;
+    }
+    // Release: we are done with these slots, the module may reuse them
+    __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  res->elapsed = (now_ns() - start) / 1e9;
+  res->received = received;
+  res->sweeps = sweeps;
+  res->dropped = __atomic_load_n(&header->dropped, __ATOMIC_RELAXED);
+  res->missed = __atomic_load_n(&header->missed, __ATOMIC_RELAXED);
+  res->lost = res->dropped + res->missed * nr_pids;
+  res->nr_records = header->nr_records;
+
+  munmap(header, size);
+  close(fd);
+  return 0;
+}
+
+static double loss(const struct result *res) {
+  uint64_t total = res->received + res->lost;
+  return total ? 100.0 * res->lost / total : 0.0;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int period_us = 1000, nr_records = 65536;
+  double seconds = 5;
+  int verbose = 0, sweep = 0, opt;
+
+  while ((opt = getopt(argc, argv, "p:n:t:vs")) != -1) {
+    switch (opt) {
+    case 'p':
+      period_us = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      nr_records = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      seconds = strtod(optarg, NULL);
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 's':
+      sweep = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  int nr_pids = argc - optind;
+  if (nr_pids <= 0)
+    usage(argv[0]);
+
+  __s32 *pids = calloc(nr_pids, sizeof(__s32));
+  if (pids == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  for (int i = 0; i < nr_pids; i++)
+    pids[i] = atoi(argv[optind + i]);
+
+  struct result res;
+  if (!sweep) {
+    if (sample(period_us, nr_records, pids, nr_pids, seconds, verbose,
+               &res) != 0)
+      return 1;
+    printf("period %u us, %d pids, %u records, %.2f s\n", period_us, nr_pids,
+           res.nr_records, res.elapsed);
+    printf("received %llu samples in %llu sweeps (%.0f samples/s)\n",
+           (unsigned long long)res.received, (unsigned long long)res.sweeps,
+           res.received / res.elapsed);
+    printf("dropped %llu samples (ring full), missed %llu periods\n",
+           (unsigned long long)res.dropped, (unsigned long long)res.missed);
+    printf("loss %.2f%%\n", loss(&res));
+    free(pids);
+    return 0;
+  }
+
+  // The module allows periods down to 100 us and a million samples a second
+  unsigned int min_period = nr_pids > 100 ? nr_pids : 100;
+  unsigned int first_loss = 0;
+
+  printf("%d pids, %u records, %.1f s per period\n", nr_pids, nr_records,
+         seconds);
+  printf("%10s %12s %9s %8s %8s\n", "period_us", "samples/s", "dropped",
+         "missed", "loss");
+  for (unsigned int p = period_us;;) {
+    if (sample(p, nr_records, pids, nr_pids, seconds, 0, &res) != 0)
+      return 1;
+    printf("%10u %12.0f %9llu %8llu %7.2f%%\n", p,
+           res.received / res.elapsed, (unsigned long long)res.dropped,
+           (unsigned long long)res.missed, loss(&res));
+    fflush(stdout);
+    if (first_loss == 0 && loss(&res) >= 1.0)
+      first_loss = p;
+    if (p <= min_period)
+      break;
+    p = p / 2 > min_period ? p / 2 : min_period;
+  }
+  if (first_loss != 0)
+    printf("loss reaches 1%% at %u us (%.0f samples/s requested)\n",
+           first_loss, nr_pids * 1e6 / first_loss);
+  else
+    printf("loss stays under 1%% down to %u us\n", min_period);
+
+  free(pids);
+  return 0;
+}
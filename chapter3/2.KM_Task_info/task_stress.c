@@ -0,0 +1,133 @@
+// Stress test of /proc/pid from many threads at once: every thread opens the
+// file, writes its own thread ID and reads it back, over and over, and checks
+// that the answer is about that thread and not one queried by another.
+//
+// Usage: task_stress [-j threads] [-t seconds] [-o]
+//
+// With -o every query opens and closes the file again, which also exercises
+// the allocation of each open file's query.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PID_PATH "/proc/pid"
+
+struct worker {
+  pthread_t thread;
+  uint64_t queries;
+  uint64_t mismatches;
+};
+
+static double seconds = 5;
+static int reopen;
+static volatile int stop;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-j threads] [-t seconds] [-o]\n", name);
+  exit(2);
+}
+
+// Write our TID, read the answer and check its "pid = [N]" line
+static void *run(void *arg) {
+  struct worker *w = arg;
+  char query[16], expect[32], buf[1024];
+  int fd = -1;
+
+  int len = snprintf(query, sizeof(query), "%d", gettid());
+  snprintf(expect, sizeof(expect), "pid = [%d]", gettid());
+
+  while (!stop) {
+    if (fd == -1 && (fd = open(PID_PATH, O_RDWR)) == -1) {
+      perror(PID_PATH);
+      exit(1);
+    }
+    ssize_t n;
+    if (write(fd, query, len) != len ||
+        (n = pread(fd, buf, sizeof(buf) - 1, 0)) < 0) {
+      perror(PID_PATH);
+      exit(1);
+    }
+    buf[n] = '\0';
+    if (strstr(buf, expect) == NULL)
+      w->mismatches++;
+    w->queries++;
+    if (reopen) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd != -1)
+    close(fd);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int nr_threads = 4, opt;
+
+  while ((opt = getopt(argc, argv, "j:t:o")) != -1) {
+    switch (opt) {
+    case 'j':
+      nr_threads = atoi(optarg);
+      break;
+    case 't':
+      seconds = strtod(optarg, NULL);
+      break;
+    case 'o':
+      reopen = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nr_threads <= 0)
+    usage(argv[0]);
+
+  struct worker *workers = calloc(nr_threads, sizeof(*workers));
+  if (workers == NULL) {
+    perror("calloc");
+    return 1;
+  }
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < nr_threads; i++) {
+    int err = pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      return 1;
+    }
+  }
+  usleep((useconds_t)(seconds * 1e6));
+  stop = 1;
+
+  uint64_t queries = 0, mismatches = 0;
+  for (int i = 0; i < nr_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    queries += workers[i].queries;
+    mismatches += workers[i].mismatches;
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("%d threads, %s, %.2f s\n", nr_threads,
+         reopen ? "open per query" : "one open per thread", elapsed);
+  printf("%llu queries (%.0f/s, %.0f/s per thread)\n",
+         (unsigned long long)queries, queries / elapsed,
+         queries / elapsed / nr_threads);
+  printf("%llu answers about another thread's query\n",
+         (unsigned long long)mismatches);
+
+  free(workers);
+  return mismatches != 0;
+}